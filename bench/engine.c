@@ -0,0 +1,409 @@
+/*
+Copyright (C) 2026 Gabriel Golfetti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "engine.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// cost of whole engine cycles against a fake graph that hands out buffers the
+// way a filter does and a host that copies its inputs to its outputs, with a
+// fake clock so that every run goes through the same cycles
+
+#define QUANTUM 256
+#define RATE 48000
+#define CYCLES 20000
+#define READS 1000000
+// a busy session, with a few targets that never show up
+#define NODES 64
+#define NODE_PORTS 16
+#define TARGETS 128
+#define ROUNDS 100
+
+struct fake {
+  size_t n_channels;
+  size_t *ports, *next;
+  struct pw_buffer *buffers;
+  struct spa_buffer *spa_buffers;
+  struct spa_data *datas;
+  struct spa_chunk *chunks;
+  struct engine *engine;
+};
+
+static struct pw_buffer *_dequeue(void *_data, void *port) {
+  struct fake *fake = _data;
+  size_t c = *(size_t *)port;
+  struct pw_buffer *buf = &fake->buffers[2 * c + fake->next[c]];
+  fake->next[c] = !fake->next[c];
+  return buf;
+}
+static void _queue(void *, void *, struct pw_buffer *) {}
+static void _swap(void *_data, size_t idx, uint64_t, uint64_t, uint32_t) {
+  struct fake *fake = _data;
+  struct engine *engine = fake->engine;
+  size_t block = engine->reblock.on ? engine->reblock.block : QUANTUM;
+  const float *in = nullptr;
+  for (size_t i = 0; i < engine->n_channels; i++) {
+    struct channel *channel = &engine->channels[i];
+    float *buf = engine->buffer + channel->host[idx] / sizeof(float);
+    if (channel->dir == PW_DIRECTION_INPUT)
+      in = buf;
+    else if (in)
+      memcpy(buf, in, block * sizeof(float));
+  }
+}
+static int64_t _host_offset(void *) { return 0; }
+static const struct engine_ops fake_ops = {
+    .dequeue = _dequeue,
+    .queue = _queue,
+    .swap = _swap,
+    .host_offset = _host_offset,
+};
+
+static double _now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+enum mode { MODE_SYNC, MODE_SAFE, MODE_REBLOCK, MODE_RESAMPLE, N_MODES };
+static const char *const mode_names[N_MODES] = {"sync", "safe", "reblock",
+                                                "resample"};
+
+static void _clear(struct engine *engine, struct fake *fake) {
+  engine_clear_reblock(&engine->reblock);
+  free(engine->watchdog.last);
+  free(engine->channels);
+  free(engine->buffer);
+  free(fake->ports);
+  free(fake->next);
+  free(fake->buffers);
+  free(fake->spa_buffers);
+  free(fake->datas);
+  free(fake->chunks);
+}
+
+// half of the channels are inputs and half outputs, like a duplex device
+static int _bench(enum mode mode, size_t n_channels) {
+  struct fake fake = {.n_channels = n_channels};
+  struct engine engine = {
+      .ops = &fake_ops,
+      .data = &fake,
+      .fd = -1,
+      .sanitize = mode == MODE_SAFE,
+  };
+  fake.engine = &engine;
+  bool reblock = mode == MODE_REBLOCK || mode == MODE_RESAMPLE;
+  size_t block = mode == MODE_REBLOCK ? 96 : QUANTUM;
+  engine.maxsize = reblock ? MAX_QUANTUM : QUANTUM;
+  engine.blocksize = reblock ? block : 0;
+  engine.n_slots = n_channels;
+  engine.n_channels = n_channels;
+
+  int res = -1;
+  if (!(engine.channels = calloc(n_channels, sizeof *engine.channels)) ||
+      !(engine.buffer = calloc(1, engine_arena_size(&engine, n_channels))) ||
+      !(fake.ports = calloc(n_channels, sizeof *fake.ports)) ||
+      !(fake.next = calloc(n_channels, sizeof *fake.next)) ||
+      !(fake.buffers = calloc(2 * n_channels, sizeof *fake.buffers)) ||
+      !(fake.spa_buffers = calloc(2 * n_channels, sizeof *fake.spa_buffers)) ||
+      !(fake.datas = calloc(2 * n_channels, sizeof *fake.datas)) ||
+      !(fake.chunks = calloc(2 * n_channels, sizeof *fake.chunks)))
+    goto cleanup;
+
+  for (size_t c = 0; c < n_channels; c++) {
+    struct channel *channel = &engine.channels[c];
+    fake.ports[c] = c;
+    *channel = (struct channel){
+        .port = &fake.ports[c],
+        .idx = c / 2,
+        .dir = c % 2 ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT,
+        .slot = c,
+    };
+    size_t base = 2 * c * (engine.maxsize + engine.blocksize);
+    for (size_t b = 0; b < 2; b++) {
+      channel->offset[b] = (base + b * engine.maxsize) * sizeof(float);
+      channel->host[b] =
+          engine.blocksize
+              ? (base + 2 * engine.maxsize + b * engine.blocksize) *
+                    sizeof(float)
+              : channel->offset[b];
+      size_t k = 2 * c + b;
+      fake.datas[k].chunk = &fake.chunks[k];
+      fake.spa_buffers[k] = (struct spa_buffer){
+          .n_datas = 1,
+          .datas = &fake.datas[k],
+      };
+      fake.buffers[k].buffer = &fake.spa_buffers[k];
+      engine_add_buffer(&engine, c, &fake.buffers[k]);
+    }
+    // a tone on the inputs, the safe mode has to scan real samples
+    float *buf = engine.buffer + channel->offset[0] / sizeof(float);
+    for (size_t i = 0; i < QUANTUM; i++)
+      buf[i] = sinf(i * 0.01f);
+    memcpy(engine.buffer + channel->offset[1] / sizeof(float), buf,
+           QUANTUM * sizeof(float));
+    for (size_t b = 0; b < 2; b++)
+      fake.chunks[2 * c + b].size = QUANTUM * sizeof(float);
+  }
+
+  struct reblock *rb = &engine.reblock;
+  rb->host_rate = mode == MODE_RESAMPLE ? 44100 : RATE;
+  if ((rb->on = reblock) &&
+      engine_setup_reblock(&engine, block, RATE, RESAMPLE_MEDIUM) < 0)
+    goto cleanup;
+  if (mode == MODE_SAFE) {
+    engine.watchdog.mode = WATCHDOG_FADE;
+    if (!(engine.watchdog.last =
+              calloc(n_channels * engine.maxsize, sizeof(float))))
+      goto cleanup;
+  }
+  atomic_store(&engine.running, true);
+
+  struct spa_io_position pos = {
+      .clock =
+          {
+              .id = 1,
+              .rate = {1, RATE},
+              .duration = QUANTUM,
+              .rate_diff = 1.0,
+              // far enough for the watchdog to never fire
+              .next_nsec = INT64_MAX,
+          },
+  };
+  double start = _now();
+  for (size_t i = 0; i < CYCLES; i++) {
+    pos.clock.nsec = pos.clock.position * SPA_NSEC_PER_SEC / RATE;
+    engine_process(&engine, &pos);
+    pos.clock.position += QUANTUM;
+  }
+  double elapsed = _now() - start;
+
+  printf("%-8s %4zu channels %10.1f ns/cycle %8.2f ns/channel\n",
+         mode_names[mode], n_channels, elapsed / CYCLES,
+         elapsed / CYCLES / n_channels);
+  res = 0;
+
+cleanup:
+  _clear(&engine, &fake);
+  return res;
+}
+
+// what GetSamplePosition pays for each query on top of the ASIO call
+static void _bench_clock(void) {
+  struct engine engine = {};
+  struct snapshot snap = {};
+  double start = _now();
+  for (size_t i = 0; i < READS; i++) {
+    snap = engine_read_clock(&engine.clock);
+    __asm__ volatile("" : : "g"(&snap) : "memory");
+  }
+  printf("clock read %28.1f ns/read\n", (_now() - start) / READS);
+}
+
+// the registry side: filter ports linked to a graph of as many nodes with as
+// many ports each, which the driver keeps from its thread loop
+static char _link_token;
+static void *_link(void *, const struct port *, enum pw_direction, uint32_t) {
+  return &_link_token;
+}
+static void _unlink(void *, void *) {}
+static void _remove_port(void *, const struct channel *) {}
+static const struct engine_ops graph_ops = {
+    .link = _link,
+    .unlink = _unlink,
+    .remove_port = _remove_port,
+};
+
+// what the port configuration lists, the last few targets missing
+static char *_targets(void) {
+  size_t len = 1;
+  for (size_t i = 0; i < TARGETS; i++)
+    len += snprintf(nullptr, 0, "node.%zu:out_%zu", i / NODE_PORTS,
+                    i % NODE_PORTS + (i >= TARGETS - 4) * NODE_PORTS) +
+           1;
+  char *ports, *p;
+  if (!(p = ports = malloc(len)))
+    return nullptr;
+  for (size_t i = 0; i < TARGETS; i++)
+    p += sprintf(p, "node.%zu:out_%zu", i / NODE_PORTS,
+                 i % NODE_PORTS + (i >= TARGETS - 4) * NODE_PORTS) +
+         1;
+  *p = '\0';
+  return ports;
+}
+
+static int _add_graph(struct engine *engine) {
+  for (uint32_t n = 0; n < NODES; n++) {
+    char name[64], display[64];
+    snprintf(name, sizeof name, "node.%u", n);
+    snprintf(display, sizeof display, "Node %u", n);
+    uint32_t id = 1000 + n * (NODE_PORTS + 1);
+    struct node *node;
+    if (engine_add_node(&engine->graph, id, name, display) < 0 ||
+        !(node = engine_find_node(&engine->graph, id)))
+      return -1;
+    for (size_t i = 0; i < NODE_PORTS; i++) {
+      snprintf(name, sizeof name, "out_%zu", i);
+      if (engine_add_port(engine, node, PW_DIRECTION_OUTPUT, id + 1 + i, i,
+                          name) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+static void _remove_graph(struct engine *engine) {
+  for (uint32_t n = 0; n < NODES; n++) {
+    uint32_t id = 1000 + n * (NODE_PORTS + 1);
+    for (size_t i = 0; i < NODE_PORTS; i++)
+      engine_remove_global(engine, id + 1 + i);
+    engine_remove_global(engine, id);
+  }
+}
+
+static int _bench_registry(const char *ports) {
+  struct engine engine = {.ops = &graph_ops};
+  if (engine_init_graph(&engine.graph) < 0)
+    return -1;
+  int res = -1;
+  for (size_t i = 0; i < TARGETS; i++)
+    if (engine_add_port(&engine, engine.graph.unknown, PW_DIRECTION_OUTPUT,
+                        i + 1, i, engine_get_port(ports, i)) < 0)
+      goto cleanup;
+
+  double added = 0, removed = 0;
+  for (size_t r = 0; r < ROUNDS; r++) {
+    double start = _now();
+    if (_add_graph(&engine) < 0)
+      goto cleanup;
+    double mid = _now();
+    _remove_graph(&engine);
+    added += mid - start;
+    removed += _now() - mid;
+  }
+  size_t n = ROUNDS * NODES * (NODE_PORTS + 1);
+  printf("registry add %26.1f ns/global\n", added / n);
+  printf("registry remove %23.1f ns/global\n", removed / n);
+  res = 0;
+
+cleanup:
+  engine_clear_graph(&engine.graph);
+  return res;
+}
+
+// naming channels once per port configuration or retarget, and what
+// GetChannelInfo looks up per channel
+static int _bench_table(const char *ports) {
+  struct engine engine = {.ops = &graph_ops};
+  struct table table = {};
+  int res = -1;
+  if (engine_init_graph(&engine.graph) < 0 || _add_graph(&engine) < 0)
+    goto cleanup;
+
+  double start = _now();
+  for (size_t r = 0; r < ROUNDS; r++) {
+    free(table.entries);
+    if (engine_build_table(&engine.graph, ports, &table) < 0)
+      goto cleanup;
+  }
+  printf("table build %27.1f ns/channel\n",
+         (_now() - start) / ROUNDS / TARGETS);
+
+  char name[MAX_CHANNEL_NAME];
+  start = _now();
+  for (size_t i = 0; i < READS; i++) {
+    const struct entry *entry = engine_entry(&table, i % (TARGETS + 1));
+    if (entry)
+      strcpy(name, entry->name);
+    __asm__ volatile("" : : "g"(name) : "memory");
+  }
+  printf("table lookup %26.1f ns/lookup\n", (_now() - start) / READS);
+  res = 0;
+
+cleanup:
+  free(table.entries);
+  engine_clear_graph(&engine.graph);
+  return res;
+}
+
+// what CreateBuffers pays to go from all channels to half of them and back,
+// keeping the ports of those in both
+static int _bench_channels(void) {
+  static size_t port;
+  struct engine engine = {
+      .ops = &graph_ops,
+      .fd = -1,
+      .buffer = MAP_FAILED,
+      .maxsize = QUANTUM,
+  };
+  int res = -1;
+  double start = _now();
+  for (size_t r = 0; r < ROUNDS; r++) {
+    size_t n = r % 2 ? TARGETS / 2 : TARGETS;
+    struct channel *channels;
+    if (!(channels = calloc(n, sizeof *channels)))
+      goto cleanup;
+    for (size_t c = 0; c < n; c++)
+      channels[c] = (struct channel){
+          .idx = c / 2,
+          .dir = c % 2 ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT,
+      };
+    if (engine_setup_channels(&engine, channels, n) < 0)
+      goto cleanup;
+    for (size_t c = 0; c < n; c++)
+      if (!engine.channels[c].port)
+        engine.channels[c].port = &port;
+  }
+  printf("channel setup %25.1f ns/channel\n",
+         (_now() - start) / ROUNDS / (TARGETS * 3 / 4));
+  res = 0;
+
+cleanup:
+  free(engine.channels);
+  if (engine.buffer != MAP_FAILED)
+    munmap(engine.buffer, engine_arena_size(&engine, engine.n_slots));
+  if (engine.fd >= 0)
+    close(engine.fd);
+  return res;
+}
+
+int main(void) {
+  static const size_t channels[] = {2, 8, 32, 128};
+  for (int mode = 0; mode < N_MODES; mode++)
+    for (size_t i = 0; i < sizeof channels / sizeof *channels; i++)
+      if (_bench(mode, channels[i]) < 0) {
+        fprintf(stderr, "unable to set up %s with %zu channels\n",
+                mode_names[mode], channels[i]);
+        return EXIT_FAILURE;
+      }
+  _bench_clock();
+
+  char *ports;
+  if (!(ports = _targets()) || _bench_registry(ports) < 0 ||
+      _bench_table(ports) < 0 || _bench_channels() < 0) {
+    fprintf(stderr, "unable to set up the graph\n");
+    free(ports);
+    return EXIT_FAILURE;
+  }
+  free(ports);
+  return EXIT_SUCCESS;
+}
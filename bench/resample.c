@@ -0,0 +1,83 @@
+/*
+Copyright (C) 2026 Gabriel Golfetti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "resample.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// CPU cost of every preset for the usual 44.1 kHz <-> 48 kHz conversions,
+// in the same cycle sized calls the driver makes
+
+#define QUANTUM 256
+#define CYCLES 20000
+
+static double _now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int _bench(unsigned in_rate, unsigned out_rate,
+                  enum resample_quality quality) {
+  struct resampler r = {};
+  struct resample_state s = {};
+  float *in = nullptr, *out = nullptr;
+  size_t n_out = (size_t)QUANTUM * out_rate / in_rate + 2;
+  int res;
+  if ((res = resampler_init(&r, in_rate, out_rate, quality)) < 0 ||
+      (res = resample_state_init(&s, &r, QUANTUM)) < 0)
+    goto cleanup;
+  if (!(in = malloc(QUANTUM * sizeof *in)) ||
+      !(out = malloc(n_out * sizeof *out))) {
+    res = -1;
+    goto cleanup;
+  }
+  for (size_t i = 0; i < QUANTUM; i++)
+    in[i] = sinf(i * 0.01f);
+
+  size_t frames = 0;
+  double start = _now();
+  for (size_t i = 0; i < CYCLES; i++)
+    frames += resample_run(&r, &s, in, QUANTUM, out, n_out);
+  double elapsed = _now() - start;
+
+  printf("%6u -> %6u %-6s %3zu taps %8.2f ns/frame %8.1fx realtime\n",
+         in_rate, out_rate, resample_names[quality], r.taps, elapsed / frames,
+         frames * 1e9 / out_rate / elapsed);
+
+cleanup:
+  free(in);
+  free(out);
+  resample_state_clear(&s);
+  resampler_clear(&r);
+  return res;
+}
+
+int main(void) {
+  static const unsigned rates[][2] = {{44100, 48000}, {48000, 44100}};
+  for (size_t i = 0; i < sizeof rates / sizeof *rates; i++)
+    for (int q = RESAMPLE_LOW; q < N_RESAMPLE_QUALITIES; q++)
+      if (_bench(rates[i][0], rates[i][1], q) < 0) {
+        fprintf(stderr, "unable to convert %u to %u\n", rates[i][0],
+                rates[i][1]);
+        return EXIT_FAILURE;
+      }
+  return EXIT_SUCCESS;
+}
@@ -42,8 +42,8 @@ enum asio_time_info_flags {
 
 struct asio_time_info {
   DOUBLE speed;
-  LONG64 sys_time;
-  LONG64 sample_pos;
+  struct asio_timestamp sys_time;
+  struct asio_samples sample_pos;
   DOUBLE sample_rate;
   LONG32 flags;
   CHAR _[12];
@@ -82,6 +82,12 @@ enum asio_message {
   ASIO_MESSAGE_COUNT,
 };
 
+// driver specific Future selectors, kept clear of those defined by the SDK
+enum asio_future {
+  // opt points to a LONG32, nonzero to move to the freewheel driver
+  ASIO_FUTURE_FREEWHEEL = 0x70770001l,
+};
+
 struct asio_callbacks {
   VOID(CALLBACK *swap_buffers)(LONG32 idx, LONG32 direct);
   VOID(CALLBACK *sample_rate_change)(DOUBLE rate);
@@ -0,0 +1,16 @@
+#ifndef __PWASIO_DEBUG_H__
+#define __PWASIO_DEBUG_H__
+
+// logging goes through the wine debugging channel in debug builds, and is
+// compiled out otherwise, which also keeps the parts built natively free of
+// Wine
+#ifdef DEBUG
+#include <wine/debug.h>
+#else
+#define WINE_DEFAULT_DEBUG_CHANNEL(...)
+#define WINE_TRACE(...)
+#define WINE_WARN(...)
+#define WINE_ERR(...)
+#endif
+
+#endif // !__PWASIO_DEBUG_H__
@@ -0,0 +1,978 @@
+/*
+Copyright (C) 2026 Gabriel Golfetti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "engine.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// free of Wine, with the graph and the host behind engine_ops, so that it
+// can be driven by fakes and benchmarked on its own
+
+static uint64_t _monotonic(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+size_t engine_arena_size(const struct engine *engine, size_t n_slots) {
+  return 2 * n_slots * (engine->maxsize + engine->blocksize) * sizeof(float);
+}
+
+static void _publish(struct clock *clock, const struct spa_io_clock *src,
+                     uint64_t time) {
+  unsigned seq = atomic_load_explicit(&clock->seq, memory_order_relaxed);
+  atomic_store_explicit(&clock->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&clock->pos, src->position, memory_order_relaxed);
+  atomic_store_explicit(&clock->nsec, src->nsec, memory_order_relaxed);
+  atomic_store_explicit(&clock->time, time, memory_order_relaxed);
+  atomic_store_explicit(&clock->rate, src->rate.denom, memory_order_relaxed);
+  atomic_store_explicit(&clock->rate_diff, src->rate_diff,
+                        memory_order_relaxed);
+  atomic_store_explicit(&clock->seq, seq + 2, memory_order_release);
+}
+struct snapshot engine_read_clock(const struct clock *clock) {
+  struct snapshot snap;
+  unsigned seq;
+  do {
+    while ((seq = atomic_load_explicit(&clock->seq, memory_order_acquire)) & 1)
+      ;
+    snap = (struct snapshot){
+        .pos = atomic_load_explicit(&clock->pos, memory_order_relaxed),
+        .nsec = atomic_load_explicit(&clock->nsec, memory_order_relaxed),
+        .time = atomic_load_explicit(&clock->time, memory_order_relaxed),
+        .rate = atomic_load_explicit(&clock->rate, memory_order_relaxed),
+        .rate_diff =
+            atomic_load_explicit(&clock->rate_diff, memory_order_relaxed),
+    };
+    atomic_thread_fence(memory_order_acquire);
+  } while (seq != atomic_load_explicit(&clock->seq, memory_order_relaxed));
+  return snap;
+}
+
+// PipeWire times cycles with CLOCK_MONOTONIC while hosts compare against QPC,
+// so cycle starts are moved over and smoothed by a delay locked loop that
+// tracks the drift of the device clock against system time
+#define DLL_BANDWIDTH 0.5 // Hz
+static double _dll_update(struct dll *dll, const struct spa_io_clock *clock,
+                          double now) {
+  double period = clock->duration * (double)SPA_NSEC_PER_SEC /
+                  (clock->rate.denom * clock->rate_diff);
+  // start over after discontinuities, quantum changes and xruns
+  if (SPA_UNLIKELY(clock->position != dll->next ||
+                   clock->duration != dll->duration ||
+                   fabs(now - dll->t1) > period)) {
+    dll->t0 = now;
+    dll->t1 = now + period;
+    dll->e2 = period;
+  } else {
+    double w = 2 * M_PI * DLL_BANDWIDTH * dll->e2 / SPA_NSEC_PER_SEC;
+    double e = now - dll->t1;
+    dll->t0 = dll->t1;
+    dll->t1 += M_SQRT2 * w * e + dll->e2;
+    dll->e2 += w * w * e;
+  }
+  dll->next = clock->position + clock->duration;
+  dll->duration = clock->duration;
+  return dll->t0;
+}
+
+void engine_clear_reblock(struct reblock *rb) {
+  free(rb->rings);
+  rb->rings = nullptr;
+  for (size_t i = 0; i < rb->n_states; i++)
+    resample_state_clear(&rb->states[i]);
+  free(rb->states);
+  rb->states = nullptr;
+  rb->n_states = 0;
+  free(rb->scratch);
+  rb->scratch = nullptr;
+  for (size_t i = 0; i < 2; i++) {
+    resample_state_clear(&rb->pacer[i]);
+    resampler_clear(&rb->resampler[i]);
+  }
+  rb->rate = 0;
+}
+static void _ring_write(float *ring, size_t mask, size_t pos, const float *src,
+                        size_t n) {
+  size_t i = pos & mask, len = SPA_MIN(n, mask + 1 - i);
+  if (src) {
+    memcpy(ring + i, src, len * sizeof(float));
+    memcpy(ring, src + len, (n - len) * sizeof(float));
+  } else {
+    memset(ring + i, 0, len * sizeof(float));
+    memset(ring, 0, (n - len) * sizeof(float));
+  }
+}
+static void _ring_read(const float *ring, size_t mask, size_t pos, float *dst,
+                       size_t n) {
+  size_t i = pos & mask, len = SPA_MIN(n, mask + 1 - i);
+  memcpy(dst, ring + i, len * sizeof(float));
+  memcpy(dst + len, ring, (n - len) * sizeof(float));
+}
+static size_t _gcd(size_t a, size_t b) {
+  while (b) {
+    size_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+const char *const watchdog_names[N_WATCHDOGS] = {"off", "fade", "repeat"};
+static void _watchdog_fill(const struct watchdog *wd, const float *last,
+                           float *dst, size_t n) {
+  size_t len = SPA_MIN(wd->len, n);
+  if (wd->mode == WATCHDOG_REPEAT && wd->misses == 1)
+    memcpy(dst, last, len * sizeof(float));
+  else
+    for (size_t i = 0; i < len; i++)
+      dst[i] = last[i] * ((float)(len - 1 - i) / len);
+  memset(dst + len, 0, (n - len) * sizeof(float));
+}
+
+// NaN, infinities and denormals are told apart from normal numbers and zeros
+// by their exponent alone, so whole vectors are checked and flushed at once
+#define SANITIZE_LANES 8
+typedef uint32_t sanitize_vec
+    __attribute__((vector_size(SANITIZE_LANES * sizeof(uint32_t))));
+static size_t _sanitize(float *buf, size_t n) {
+  sanitize_vec count = {};
+  size_t i = 0, res = 0;
+  for (; i + SANITIZE_LANES <= n; i += SANITIZE_LANES) {
+    sanitize_vec x;
+    memcpy(&x, buf + i, sizeof x);
+    sanitize_vec ok = (sanitize_vec)(((x >> 23) & 0xff) - 1 < 0xfe) |
+                      (sanitize_vec)((x & 0x7fffffff) == 0);
+    count += ~ok & 1;
+    x &= ok;
+    memcpy(buf + i, &x, sizeof x);
+  }
+  for (size_t l = 0; l < SANITIZE_LANES; l++)
+    res += count[l];
+  for (; i < n; i++)
+    if (!isnormal(buf[i]) && buf[i] != 0) {
+      buf[i] = 0;
+      res++;
+    }
+  return res;
+}
+
+bool engine_add_buffer(struct engine *engine, size_t idx,
+                       struct pw_buffer *buf) {
+  struct channel *channel = &engine->channels[idx];
+
+  struct spa_data *data = &buf->buffer->datas[0];
+  if (!channel->buffer[0]) {
+    channel->buffer[0] = buf;
+    data->mapoffset = channel->offset[0];
+  } else if (!channel->buffer[1]) {
+    channel->buffer[1] = buf;
+    data->mapoffset = channel->offset[1];
+  } else
+    return false;
+  data->type = SPA_DATA_MemFd;
+  data->flags = SPA_DATA_FLAG_READWRITE | SPA_DATA_FLAG_MAPPABLE;
+  data->fd = engine->fd;
+  data->maxsize = engine->maxsize * sizeof(float);
+  return true;
+}
+void engine_remove_buffer(struct engine *engine, size_t idx,
+                          struct pw_buffer *buf) {
+  struct channel *channel = &engine->channels[idx];
+
+  if (buf == channel->buffer[0])
+    channel->buffer[0] = nullptr;
+  if (buf == channel->buffer[1])
+    channel->buffer[1] = nullptr;
+}
+bool engine_probe(struct engine *engine, size_t out, size_t in) {
+  struct probe *probe = &engine->probe;
+  int state = atomic_load_explicit(&probe->state, memory_order_acquire);
+  if (state == PROBE_ARMED || state == PROBE_SENT ||
+      !atomic_load_explicit(&engine->running, memory_order_relaxed))
+    return false;
+  unsigned found = 0;
+  for (size_t i = 0; i < engine->n_channels; i++) {
+    const struct channel *channel = &engine->channels[i];
+    if (channel->dir == PW_DIRECTION_OUTPUT && channel->idx == out) {
+      probe->out = i;
+      found |= 1;
+    } else if (channel->dir == PW_DIRECTION_INPUT && channel->idx == in) {
+      probe->in = i;
+      found |= 2;
+    }
+  }
+  if (found != 3)
+    return false;
+  atomic_store_explicit(&probe->state, PROBE_ARMED, memory_order_release);
+  return true;
+}
+// the first sample past the threshold is taken as the click, as long as it
+// comes back within a second
+static void _probe_listen(struct engine *engine, uint64_t pos, uint32_t rate,
+                          size_t n) {
+  struct probe *probe = &engine->probe;
+  const float *in =
+      engine->buffer +
+      engine->channels[probe->in].host[engine->idx] / sizeof(float);
+  for (size_t i = 0; i < n; i++)
+    if (fabsf(in[i]) > PROBE_THRESHOLD) {
+      atomic_store_explicit(&probe->frames, pos + i - probe->sent,
+                            memory_order_relaxed);
+      atomic_store_explicit(&probe->state, PROBE_DONE, memory_order_release);
+      return;
+    }
+  if (pos + n - probe->sent > rate)
+    atomic_store_explicit(&probe->state, PROBE_FAILED, memory_order_release);
+}
+// the probed output is kept silent for as long as the click is out
+static void _probe_send(struct engine *engine, uint64_t pos, size_t n,
+                        int state) {
+  struct probe *probe = &engine->probe;
+  float *out = engine->buffer +
+               engine->channels[probe->out].host[engine->idx] / sizeof(float);
+  memset(out, 0, n * sizeof(float));
+  if (state == PROBE_ARMED) {
+    out[0] = 1.0f;
+    probe->sent = pos;
+    atomic_store_explicit(&probe->state, PROBE_SENT, memory_order_relaxed);
+  }
+}
+static void _load_update(struct load *load, uint64_t spent, uint64_t budget) {
+  unsigned permille = SPA_MIN(spent * 1000 / budget, UINT_MAX);
+  if (spent > budget)
+    atomic_fetch_add_explicit(&load->overruns, 1, memory_order_relaxed);
+  if (permille > atomic_load_explicit(&load->peak, memory_order_relaxed))
+    atomic_store_explicit(&load->peak, permille, memory_order_relaxed);
+}
+static void _swap(struct engine *engine, uint64_t pos, uint64_t time,
+                  uint32_t rate, size_t n) {
+  int state =
+      atomic_load_explicit(&engine->probe.state, memory_order_acquire);
+  if (SPA_UNLIKELY(state == PROBE_SENT))
+    _probe_listen(engine, pos, rate, n);
+  struct flight *flight = &engine->flight;
+  bool timed = engine->load.on || flight->recording;
+  uint64_t start = timed ? _monotonic() : 0;
+  engine->ops->swap(engine->data, engine->idx, pos, time, rate);
+  if (timed) {
+    uint64_t end = _monotonic();
+    if (engine->load.on)
+      _load_update(&engine->load, end - start, n * SPA_NSEC_PER_SEC / rate);
+    if (flight->recording) {
+      if (!flight->cycle.start)
+        flight->cycle.start = start;
+      flight->cycle.end = end;
+      flight->cycle.idx = engine->idx;
+    }
+  }
+  if (SPA_UNLIKELY(state == PROBE_ARMED || state == PROBE_SENT))
+    _probe_send(engine, pos, n, state);
+}
+static void _reblock(struct engine *engine, const struct spa_io_clock *clock,
+                     uint64_t time, bool running, size_t n) {
+  struct reblock *rb = &engine->reblock;
+  struct resampler *r = rb->resampler;
+  size_t block = rb->block;
+
+  // converters only work at the graph rate they were built for
+  if (SPA_UNLIKELY(!running || (rb->rate && clock->rate.denom != rb->rate))) {
+    rb->quantum = 0;
+    for (size_t i = 0; running && i < engine->n_channels; i++) {
+      struct channel channel = engine->channels[i];
+      if (channel.dir != PW_DIRECTION_INPUT && channel.dequeued)
+        memset(engine->buffer + channel.dequeued->buffer->datas[0].mapoffset /
+                                    sizeof(float),
+               0, n * sizeof(float));
+    }
+    return;
+  }
+
+  // the host is called as soon as a block is complete, so priming outputs
+  // with the largest remainder that can be left over keeps them fed, or a
+  // whole block when converting rates makes the remainder wander
+  if (SPA_UNLIKELY(n != rb->quantum)) {
+    size_t prime = rb->rate ? block : block - _gcd(n, block);
+    rb->quantum = n;
+    rb->in_r = rb->in_w = rb->out_r = 0;
+    rb->out_w = prime;
+    for (size_t i = 0; i < engine->n_channels; i++) {
+      if (engine->channels[i].dir != PW_DIRECTION_INPUT)
+        _ring_write(rb->rings + i * rb->size, rb->mask, 0, nullptr, prime);
+      if (rb->rate)
+        resample_state_reset(&rb->states[i], &r[engine->channels[i].dir]);
+    }
+    size_t latency[2] = {prime, prime};
+    if (rb->rate)
+      for (size_t i = 0; i < 2; i++) {
+        resample_state_reset(&rb->pacer[i], &r[i]);
+        latency[i] += i == PW_DIRECTION_INPUT
+                          ? resampler_delay(&r[i]) * rb->host_rate / rb->rate
+                          : resampler_delay(&r[i]);
+      }
+    for (size_t i = 0; i < 2; i++)
+      atomic_store_explicit(&rb->latency[i], latency[i], memory_order_relaxed);
+  }
+
+  size_t produced = n;
+  if (rb->rate)
+    produced = resample_run(&r[PW_DIRECTION_INPUT],
+                            &rb->pacer[PW_DIRECTION_INPUT], nullptr, n,
+                            nullptr, SIZE_MAX);
+  for (size_t i = 0; i < engine->n_channels; i++) {
+    struct channel channel = engine->channels[i];
+    if (channel.dir != PW_DIRECTION_INPUT)
+      continue;
+    float *ring = rb->rings + i * rb->size;
+    const float *src = nullptr;
+    size_t len = 0;
+    if (SPA_LIKELY(channel.dequeued)) {
+      struct spa_data *d = &channel.dequeued->buffer->datas[0];
+      len = SPA_MIN(d->chunk->size / sizeof(float), n);
+      src = engine->buffer + (d->mapoffset + d->chunk->offset) / sizeof(float);
+    }
+    if (!rb->rate) {
+      _ring_write(ring, rb->mask, rb->in_w, src, len);
+      _ring_write(ring, rb->mask, rb->in_w + len, nullptr, n - len);
+      continue;
+    }
+    struct resample_state *state = &rb->states[i];
+    size_t k = resample_run(&r[PW_DIRECTION_INPUT], state, src, len,
+                            rb->scratch, produced);
+    k += resample_run(&r[PW_DIRECTION_INPUT], state, nullptr, n - len,
+                      rb->scratch + k, produced - k);
+    _ring_write(ring, rb->mask, rb->in_w, rb->scratch, k);
+  }
+  rb->in_w += produced;
+
+  while (rb->in_w - rb->in_r >= block) {
+    for (size_t i = 0; i < engine->n_channels; i++) {
+      struct channel channel = engine->channels[i];
+      if (channel.dir == PW_DIRECTION_INPUT)
+        _ring_read(rb->rings + i * rb->size, rb->mask, rb->in_r,
+                   engine->buffer + channel.host[engine->idx] / sizeof(float),
+                   block);
+    }
+    // the block started this many host frames before the end of the cycle
+    double ratio = (double)rb->host_rate / clock->rate.denom;
+    double offset = n * ratio - (double)(rb->in_w - rb->in_r);
+    _swap(engine, clock->position * ratio + offset,
+          time + offset * SPA_NSEC_PER_SEC / rb->host_rate, rb->host_rate,
+          block);
+    for (size_t i = 0; i < engine->n_channels; i++) {
+      struct channel channel = engine->channels[i];
+      if (channel.dir != PW_DIRECTION_INPUT)
+        _ring_write(rb->rings + i * rb->size, rb->mask, rb->out_w,
+                    engine->buffer + channel.host[engine->idx] / sizeof(float),
+                    block);
+    }
+    rb->in_r += block;
+    rb->out_w += block;
+    engine->idx = !engine->idx;
+  }
+
+  size_t needed =
+      rb->rate ? resample_needed(&rb->pacer[PW_DIRECTION_OUTPUT],
+                                 &r[PW_DIRECTION_OUTPUT], n)
+               : n;
+  bool ready = rb->out_w - rb->out_r >= needed;
+  for (size_t i = 0; i < engine->n_channels; i++) {
+    struct channel channel = engine->channels[i];
+    if (channel.dir == PW_DIRECTION_INPUT)
+      continue;
+    float *ring = rb->rings + i * rb->size, *dst = nullptr;
+    if (channel.dequeued)
+      dst = engine->buffer +
+            channel.dequeued->buffer->datas[0].mapoffset / sizeof(float);
+    if (SPA_UNLIKELY(!ready)) {
+      if (dst)
+        memset(dst, 0, n * sizeof(float));
+    } else if (!rb->rate) {
+      if (dst)
+        _ring_read(ring, rb->mask, rb->out_r, dst, n);
+    } else {
+      // channels without a buffer still have to keep their history in step
+      _ring_read(ring, rb->mask, rb->out_r, rb->scratch, needed);
+      resample_run(&r[PW_DIRECTION_OUTPUT], &rb->states[i], rb->scratch,
+                   needed, dst, n);
+    }
+  }
+  if (SPA_LIKELY(ready)) {
+    if (rb->rate)
+      resample_run(&r[PW_DIRECTION_OUTPUT], &rb->pacer[PW_DIRECTION_OUTPUT],
+                   nullptr, needed, nullptr, n);
+    rb->out_r += needed;
+  }
+}
+void engine_process(struct engine *engine, struct spa_io_position *pos) {
+  struct flight *flight = &engine->flight;
+  if ((flight->recording =
+           flight->events &&
+           !atomic_load_explicit(&flight->frozen, memory_order_acquire)))
+    flight->cycle = (struct flight_event){
+        .nsec = pos->clock.nsec,
+        .next_nsec = pos->clock.next_nsec,
+        .wakeup = _monotonic(),
+        .rate_diff = pos->clock.rate_diff,
+        .duration = pos->clock.duration,
+    };
+
+  // moving to or from the freewheel driver switches clocks, whose positions
+  // are stitched together so that hosts see theirs advance monotonically
+  struct spa_io_clock clock = pos->clock;
+  if (SPA_UNLIKELY(clock.id != engine->clock_id)) {
+    engine->clock_id = clock.id;
+    engine->pos_offset = engine->next_pos - clock.position;
+  }
+  clock.position += engine->pos_offset;
+  bool discont = clock.position != engine->next_pos;
+  engine->next_pos = clock.position + clock.duration;
+
+  double now = clock.nsec + engine->ops->host_offset(engine->data);
+  uint64_t time = _dll_update(&engine->dll, &clock, now);
+  _publish(&engine->clock, &clock, time);
+
+  if (SPA_UNLIKELY(pos->clock.duration != engine->duration ||
+                   pos->clock.rate.denom != engine->rate)) {
+    engine->duration = pos->clock.duration;
+    engine->rate = pos->clock.rate.denom;
+    if (engine->ops->reschedule)
+      engine->ops->reschedule(engine->data, engine->duration, engine->rate);
+  }
+
+  bool running = atomic_load_explicit(&engine->running, memory_order_acquire);
+  int state = atomic_load_explicit(&engine->probe.state, memory_order_relaxed);
+  if (SPA_UNLIKELY(!running && (state == PROBE_ARMED || state == PROBE_SENT)))
+    atomic_store_explicit(&engine->probe.state, PROBE_FAILED,
+                          memory_order_release);
+  size_t n = SPA_MIN(pos->clock.duration, engine->maxsize);
+  size_t size = n * sizeof(float);
+
+  // the half handed to the host is the one backing the dequeued buffers, so
+  // that a skipped or late cycle can't get both sides out of step, channels
+  // that still disagree get their data moved across halves
+  bool found = false;
+  struct pw_buffer *buf;
+  for (size_t i = 0; i < engine->n_channels; i++) {
+    struct channel *channel = &engine->channels[i];
+    if (SPA_UNLIKELY(!channel->port) ||
+        !(buf = engine->ops->dequeue(engine->data, channel->port)))
+      continue;
+    if (SPA_UNLIKELY(buf != channel->buffer[0] && buf != channel->buffer[1])) {
+      engine->ops->queue(engine->data, channel->port, buf);
+      continue;
+    }
+    channel->dequeued = buf;
+    if (!found && !engine->reblock.on) {
+      engine->idx = buf == channel->buffer[1];
+      found = true;
+    }
+  }
+
+  if (engine->reblock.on)
+    _reblock(engine, &clock, time, running, n);
+  else {
+    for (size_t i = 0; i < engine->n_channels; i++) {
+      struct channel channel = engine->channels[i];
+      if (SPA_UNLIKELY(channel.dir == PW_DIRECTION_INPUT &&
+                       channel.dequeued &&
+                       channel.dequeued != channel.buffer[engine->idx]))
+        memcpy(engine->buffer + channel.offset[engine->idx] / sizeof(float),
+               engine->buffer + channel.offset[!engine->idx] / sizeof(float),
+               size);
+    }
+    if (SPA_LIKELY(running))
+      _swap(engine, clock.position, time, clock.rate.denom, n);
+  }
+
+  // whatever the host left by now may never have been finished, unless the
+  // graph is freewheeling and waits for it
+  struct watchdog *wd = &engine->watchdog;
+  bool late = false;
+  if (wd->mode != WATCHDOG_OFF && SPA_LIKELY(running && pos->clock.next_nsec) &&
+      !(pos->clock.flags & SPA_IO_CLOCK_FLAG_FREEWHEEL)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t over = SPA_TIMESPEC_TO_NSEC(&ts) - (int64_t)pos->clock.next_nsec;
+    if (SPA_UNLIKELY(late = over > 0)) {
+      wd->misses++;
+      atomic_fetch_add_explicit(&wd->overruns, 1, memory_order_relaxed);
+      if ((uint64_t)over >
+          atomic_load_explicit(&wd->worst, memory_order_relaxed))
+        atomic_store_explicit(&wd->worst, over, memory_order_relaxed);
+    } else
+      wd->misses = 0;
+  }
+
+  for (size_t i = 0; i < engine->n_channels; i++) {
+    struct channel channel = engine->channels[i];
+    engine->channels[i].dequeued = nullptr;
+    if (SPA_LIKELY(buf = channel.dequeued)) {
+      if (channel.dir != PW_DIRECTION_INPUT) {
+        struct spa_data *d = &buf->buffer->datas[0];
+        float *dst = engine->buffer + d->mapoffset / sizeof(float);
+        float *last = wd->last ? wd->last + i * engine->maxsize : nullptr;
+        if (SPA_UNLIKELY(!running))
+          memset(dst, 0, size);
+        else if (SPA_UNLIKELY(late))
+          _watchdog_fill(wd, last, dst, n);
+        else if (SPA_UNLIKELY(!engine->reblock.on &&
+                              buf != channel.buffer[engine->idx]))
+          memcpy(dst,
+                 engine->buffer + channel.offset[engine->idx] / sizeof(float),
+                 size);
+        size_t bad;
+        if (engine->sanitize && running && !late &&
+            SPA_UNLIKELY(bad = _sanitize(dst, n)))
+          atomic_fetch_add_explicit(&engine->channels[i].sanitized, bad,
+                                    memory_order_relaxed);
+        if (last && running && !late)
+          memcpy(last, dst, size);
+        d->chunk->offset = 0;
+        d->chunk->size = size;
+        d->chunk->stride = sizeof(float);
+        d->chunk->flags = running ? 0 : SPA_CHUNK_FLAG_EMPTY;
+      }
+      engine->ops->queue(engine->data, channel.port, buf);
+    }
+  }
+
+  if (SPA_LIKELY(running && !found && !engine->reblock.on))
+    engine->idx = !engine->idx;
+
+  // a single repeat, then a single fade
+  if (SPA_UNLIKELY(late))
+    wd->len = wd->mode == WATCHDOG_REPEAT && wd->misses == 1 ? n : 0;
+  else if (wd->mode != WATCHDOG_OFF && running)
+    wd->len = n;
+
+  if (flight->recording) {
+    struct flight_event *ev = &flight->cycle;
+    ev->position = clock.position;
+    if (running && ev->end && pos->clock.next_nsec &&
+        !(pos->clock.flags & SPA_IO_CLOCK_FLAG_FREEWHEEL) &&
+        ev->end > pos->clock.next_nsec)
+      ev->flags |= FLIGHT_OVERRUN;
+    // the first cycle recorded has nothing to follow on from
+    if (running && discont && flight->head)
+      ev->flags |= FLIGHT_DISCONT;
+    flight->events[flight->head++ & flight->mask] = *ev;
+    if (SPA_UNLIKELY(ev->flags)) {
+      atomic_store_explicit(&flight->frozen, true, memory_order_release);
+      if (engine->ops->frozen)
+        engine->ops->frozen(engine->data);
+    }
+  }
+}
+
+int engine_setup_flight(struct engine *engine, size_t n_events) {
+  struct flight *flight = &engine->flight;
+  size_t size = 1;
+  while (size < n_events)
+    size <<= 1;
+  if (!(flight->events = calloc(size, sizeof *flight->events)))
+    return -ENOMEM;
+  flight->mask = size - 1;
+  flight->head = 0;
+  atomic_store_explicit(&flight->frozen, false, memory_order_relaxed);
+  return 0;
+}
+void engine_clear_flight(struct flight *flight) {
+  free(flight->events);
+  flight->events = nullptr;
+  flight->head = 0;
+  flight->recording = false;
+}
+int engine_dump_flight(struct flight *flight, FILE *file) {
+  if (!atomic_load_explicit(&flight->frozen, memory_order_acquire))
+    return -EAGAIN;
+  int res = 0;
+  if (fprintf(file, "position,duration,rate_diff,nsec,next_nsec,wakeup,"
+                    "start,end,idx,flags\n") < 0)
+    res = -EIO;
+  size_t n = SPA_MIN(flight->head, flight->mask + 1);
+  for (size_t i = flight->head - n; res >= 0 && i < flight->head; i++) {
+    const struct flight_event *ev = &flight->events[i & flight->mask];
+    if (fprintf(file, "%lu,%u,%.9f,%lu,%lu,%lu,%lu,%lu,%u,%s%s%s\n",
+                ev->position, ev->duration, ev->rate_diff, ev->nsec,
+                ev->next_nsec, ev->wakeup, ev->start, ev->end, ev->idx,
+                ev->flags & FLIGHT_OVERRUN ? "overrun" : "",
+                ev->flags == (FLIGHT_OVERRUN | FLIGHT_DISCONT) ? "|" : "",
+                ev->flags & FLIGHT_DISCONT ? "discont" : "") < 0)
+      res = -EIO;
+  }
+  atomic_store_explicit(&flight->frozen, false, memory_order_release);
+  return res;
+}
+
+int engine_setup_reblock(struct engine *engine, size_t block,
+                         uint32_t graph_rate, enum resample_quality quality) {
+  struct reblock *rb = &engine->reblock;
+  size_t n_channels = engine->n_channels;
+  rb->block = block;
+  rb->quantum = 0;
+
+  // frames that may cross the rings on the host side in a single cycle
+  size_t span = engine->maxsize;
+  if (rb->host_rate != graph_rate) {
+    int res;
+    if ((res = resampler_init(&rb->resampler[PW_DIRECTION_INPUT],
+                              graph_rate, rb->host_rate,
+                              quality)) < 0 ||
+        (res = resampler_init(&rb->resampler[PW_DIRECTION_OUTPUT],
+                              rb->host_rate, graph_rate,
+                              quality)) < 0)
+      return res;
+    rb->rate = graph_rate;
+    span = (engine->maxsize * rb->host_rate + rb->rate - 1) / rb->rate +
+           SPA_MAX(rb->resampler[0].taps, rb->resampler[1].taps) + 2;
+    if (!(rb->scratch = malloc(span * sizeof(float))) ||
+        !(rb->states = calloc(n_channels, sizeof *rb->states)))
+      return -ENOMEM;
+    size_t max_in = SPA_MAX(engine->maxsize, span);
+    for (size_t i = 0; i < 2; i++)
+      if ((res = resample_state_init(&rb->pacer[i], &rb->resampler[i],
+                                     max_in)) < 0)
+        return res;
+    for (; rb->n_states < n_channels; rb->n_states++)
+      if ((res = resample_state_init(
+               &rb->states[rb->n_states],
+               &rb->resampler[engine->channels[rb->n_states].dir], max_in)) <
+          0)
+        return res;
+  }
+
+  for (rb->size = 1; rb->size < 2 * (rb->block + span); rb->size <<= 1)
+    ;
+  rb->mask = rb->size - 1;
+  // worst case until the graph quantum is known
+  for (size_t i = 0; i < 2; i++) {
+    size_t latency = rb->block - 1;
+    if (rb->rate)
+      latency = rb->block + (i == PW_DIRECTION_INPUT
+                                 ? resampler_delay(&rb->resampler[i]) *
+                                       rb->host_rate / rb->rate
+                                 : resampler_delay(&rb->resampler[i]));
+    atomic_store_explicit(&rb->latency[i], latency, memory_order_relaxed);
+  }
+  // inputs wait for no more than what outputs are primed with
+  rb->round_trip = rb->block - 1;
+  if (rb->rate)
+    rb->round_trip = atomic_load_explicit(&rb->latency[PW_DIRECTION_INPUT],
+                                          memory_order_relaxed) +
+                     resampler_delay(&rb->resampler[PW_DIRECTION_OUTPUT]);
+  if (!(rb->rings = calloc(n_channels * rb->size, sizeof(float))))
+    return -ENOMEM;
+  return 0;
+}
+
+
+size_t engine_count_ports(const char *ports) {
+  size_t n = 0;
+  for (const char *p = ports; *p; p += strlen(p) + 1)
+    n++;
+  return n;
+}
+size_t engine_sizeof_ports(const char *ports) {
+  const char *p = ports;
+  while (*p)
+    p += strlen(p) + 1;
+  return p - ports + 1;
+}
+const char *engine_get_port(const char *ports, size_t idx) {
+  const char *p;
+  for (p = ports; *p; p += strlen(p) + 1)
+    if (!idx--)
+      break;
+  return p;
+}
+
+static void _name_channel(const struct graph *graph, const char *target,
+                          char *name, size_t size) {
+  const char *sep = strrchr(target, ':'), *display = target;
+  if (!sep) {
+    snprintf(name, size, "%s", target);
+    return;
+  }
+  size_t len = sep - target;
+  for (const struct node *node = graph->nodes; node; node = node->next)
+    if (!strncmp(node->name, target, len) && !node->name[len]) {
+      display = node->display;
+      len = strlen(display);
+      break;
+    }
+  const char *port = sep + 1;
+  size_t room = size - SPA_MIN(size, strlen(port) + 2);
+  if (room)
+    snprintf(name, size, "%.*s %s", (int)SPA_MIN(room, len), display, port);
+  else
+    snprintf(name, size, "%s", port);
+}
+void engine_name_channels(const struct graph *graph, const char *ports,
+                          struct table *table) {
+  const char *p = ports;
+  for (size_t i = 0; i < table->len; i++, p += strlen(p) + 1)
+    _name_channel(graph, p, table->entries[i].name,
+                  sizeof table->entries[i].name);
+}
+int engine_build_table(const struct graph *graph, const char *ports,
+                       struct table *table) {
+  table->len = engine_count_ports(ports);
+  if (!(table->entries = calloc(table->len, sizeof *table->entries))) {
+    table->len = 0;
+    return -ENOMEM;
+  }
+  engine_name_channels(graph, ports, table);
+  return 0;
+}
+void engine_activate(struct table *table, bool active) {
+  for (size_t i = 0; i < table->len; i++)
+    table->entries[i].active = active;
+}
+const struct entry *engine_entry(const struct table *table, long idx) {
+  if (idx < 0 || (size_t)idx >= table->len)
+    return nullptr;
+  return &table->entries[idx];
+}
+
+int engine_init_graph(struct graph *graph) {
+  if (!(graph->nodes = graph->unknown = malloc(sizeof *graph->unknown)))
+    return -ENOMEM;
+  *graph->unknown = (struct node){
+      .id = SPA_ID_INVALID,
+      .display = "Unknown",
+  };
+  return 0;
+}
+void engine_clear_graph(struct graph *graph) {
+  for (struct node *node = graph->nodes, *next; node; node = next) {
+    for (size_t i = 0; i < 2; i++)
+      for (struct port *port = node->ports[i], *next; port; port = next) {
+        next = port->next;
+        free(port);
+      }
+    next = node->next;
+    free(node);
+  }
+  *graph = (struct graph){};
+}
+struct node *engine_find_node(const struct graph *graph, uint32_t id) {
+  for (struct node *node = graph->nodes; node; node = node->next)
+    if (node->id == id)
+      return node;
+  return nullptr;
+}
+int engine_add_node(struct graph *graph, uint32_t id, const char *name,
+                    const char *display) {
+  struct node *node;
+  if (!(node = malloc(sizeof *node)))
+    return -ENOMEM;
+  *node = (struct node){.id = id};
+  snprintf(node->name, sizeof node->name, "%s", name);
+  snprintf(node->display, sizeof node->display, "%s", display);
+
+  struct node **p = &graph->nodes;
+  while (*p && (*p)->id < id)
+    p = &(*p)->next;
+  node->next = *p;
+  *p = node;
+  return 0;
+}
+
+static void _link(struct engine *engine, struct port *target,
+                  enum pw_direction dir, uint32_t id) {
+  if (engine->ops->link &&
+      (target->link = engine->ops->link(engine->data, target, dir, id)))
+    target->peer = id;
+}
+static void _unlink(struct engine *engine, struct port *target) {
+  if (target->link && engine->ops->unlink)
+    engine->ops->unlink(engine->data, target->link);
+  target->link = nullptr;
+  target->peer = SPA_ID_INVALID;
+}
+static bool _named(const struct node *node, const struct port *port,
+                   const char *name) {
+  size_t len = strlen(node->name);
+  return !strncmp(name, node->name, len) && name[len] == ':' &&
+         !strcmp(name + len + 1, port->name);
+}
+static void _resolve(struct engine *engine, struct port *target,
+                     enum pw_direction dir) {
+  for (const struct node *node = engine->graph.nodes; node;
+       node = node->next) {
+    if (node == engine->graph.unknown)
+      continue;
+    for (const struct port *port = node->ports[dir]; port; port = port->next)
+      if (_named(node, port, target->name)) {
+        _link(engine, target, dir, port->id);
+        return;
+      }
+  }
+}
+static void _relink(struct engine *engine, const struct node *node,
+                    const struct port *port, enum pw_direction dir) {
+  for (struct port *target = engine->graph.unknown->ports[dir]; target;
+       target = target->next)
+    if (target->peer == SPA_ID_INVALID && _named(node, port, target->name))
+      _link(engine, target, dir, port->id);
+}
+static void _release(struct engine *engine, uint32_t id) {
+  for (size_t i = 0; i < 2; i++)
+    for (struct port *target = engine->graph.unknown->ports[i]; target;
+         target = target->next)
+      if (target->peer == id)
+        _unlink(engine, target);
+}
+
+int engine_add_port(struct engine *engine, struct node *node,
+                    enum pw_direction dir, uint32_t id, size_t idx,
+                    const char *name) {
+  struct port *port;
+  if (!(port = malloc(sizeof *port)))
+    return -ENOMEM;
+  *port = (struct port){
+      .idx = idx,
+      .id = id,
+      .peer = SPA_ID_INVALID,
+  };
+  snprintf(port->name, sizeof port->name, "%s", name);
+
+  struct port **p = &node->ports[dir];
+  while (*p && (*p)->idx < port->idx)
+    p = &(*p)->next;
+  port->next = *p;
+  *p = port;
+
+  if (node == engine->graph.unknown)
+    _resolve(engine, port, dir);
+  else
+    _relink(engine, node, port, dir);
+  return 0;
+}
+void engine_remove_global(struct engine *engine, uint32_t id) {
+  struct graph *graph = &engine->graph;
+  for (struct node *node = graph->nodes, *prev = nullptr; node;
+       prev = node, node = node->next)
+    if (node->id == id) {
+      for (size_t i = 0; i < 2; i++)
+        for (struct port *port = node->ports[i], *p = nullptr; port; port = p) {
+          p = port->next;
+          _release(engine, port->id);
+          free(port);
+        }
+      if (prev)
+        prev->next = node->next;
+      else
+        graph->nodes = node->next;
+      free(node);
+      return;
+    } else
+      for (size_t i = 0; i < 2; i++)
+        for (struct port *port = node->ports[i], *prev = nullptr; port;
+             prev = port, port = port->next)
+          if (port->id == id) {
+            if (prev)
+              prev->next = port->next;
+            else
+              node->ports[i] = port->next;
+            if (node == graph->unknown)
+              _unlink(engine, port);
+            else
+              _release(engine, id);
+            free(port);
+            return;
+          }
+}
+void engine_retarget(struct engine *engine, enum pw_direction dir,
+                     const char *ports) {
+  for (struct port *target = engine->graph.unknown->ports[!dir]; target;
+       target = target->next) {
+    const char *port = engine_get_port(ports, target->idx);
+    if (!strcmp(target->name, port))
+      continue;
+    _unlink(engine, target);
+    snprintf(target->name, sizeof target->name, "%s", port);
+    _resolve(engine, target, !dir);
+  }
+}
+
+int engine_setup_channels(struct engine *engine, struct channel *channels,
+                          size_t n_channels) {
+  bool *used;
+  if (!(used = calloc(engine->n_slots + n_channels, sizeof *used))) {
+    free(channels);
+    return -ENOMEM;
+  }
+
+  for (size_t c = 0; c < n_channels; c++)
+    for (size_t i = 0; i < engine->n_channels; i++) {
+      struct channel *channel = &engine->channels[i];
+      if (channel->port && channel->dir == channels[c].dir &&
+          channel->idx == channels[c].idx) {
+        channels[c] = *channel;
+        channel->port = nullptr;
+        used[channels[c].slot] = true;
+        break;
+      }
+    }
+  for (size_t i = 0; i < engine->n_channels; i++)
+    if (engine->channels[i].port && engine->ops->remove_port)
+      engine->ops->remove_port(engine->data, &engine->channels[i]);
+  free(engine->channels);
+  engine->channels = channels;
+  engine->n_channels = n_channels;
+
+  size_t n_slots = 0;
+  for (size_t c = 0, slot = 0; c < n_channels; c++) {
+    struct channel *channel = &channels[c];
+    if (!channel->port) {
+      while (used[slot])
+        slot++;
+      used[slot] = true;
+      channel->slot = slot;
+    }
+    n_slots = SPA_MAX(n_slots, channel->slot + 1);
+  }
+  free(used);
+  if (n_slots <= engine->n_slots)
+    return 0;
+
+  size_t fsize = engine_arena_size(engine, n_slots);
+  float *buffer;
+  if ((engine->fd < 0 &&
+       (engine->fd = memfd_create("pwasio-buf", MFD_CLOEXEC)) < 0) ||
+      ftruncate(engine->fd, fsize) < 0 ||
+      (buffer = engine->buffer == MAP_FAILED
+                    ? mmap(nullptr, fsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           engine->fd, 0)
+                    : mremap(engine->buffer,
+                             engine_arena_size(engine, engine->n_slots), fsize,
+                             MREMAP_MAYMOVE)) == MAP_FAILED)
+    return -errno;
+  engine->buffer = buffer;
+  engine->n_slots = n_slots;
+  return 0;
+}
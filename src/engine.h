@@ -0,0 +1,289 @@
+#ifndef __PWASIO_ENGINE_H__
+#define __PWASIO_ENGINE_H__
+
+#include "resample.h"
+
+#include <pipewire/filter.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// PipeWire's default clock.max-quantum, which is what buffers are sized for
+// when the graph quantum is not tied to the host buffer size
+#define MAX_QUANTUM 8192
+
+#define MAX_STR 1024
+// what hosts get of a channel name, ASIO_MAX_NAME
+#define MAX_CHANNEL_NAME 32
+
+struct channel {
+  size_t *port, idx;
+  enum pw_direction dir;
+  size_t slot, offset[2], host[2];
+  struct pw_buffer *buffer[2], *dequeued;
+  atomic_uint_fast64_t sanitized;
+};
+// clock state of the last cycle, written by the data thread and read by host
+// threads through a sequence lock, so that either side never blocks
+struct clock {
+  atomic_uint seq;
+  _Atomic uint64_t pos, nsec, time;
+  _Atomic uint32_t rate;
+  _Atomic double rate_diff;
+};
+struct snapshot {
+  uint64_t pos, nsec, time;
+  uint32_t rate;
+  double rate_diff;
+};
+struct dll {
+  uint64_t next;
+  size_t duration;
+  double t0, t1, e2;
+};
+
+// the host runs at its own block size on top of whatever quantum the graph
+// runs, through a ring per channel that all move in lockstep
+struct reblock {
+  bool on;
+  size_t block, quantum;
+  size_t size, mask;
+  size_t in_r, in_w, out_r, out_w;
+  float *rings;
+  atomic_size_t latency[2];
+  size_t round_trip; // worst case, for the graph
+
+  // when the host rate differs from the graph rate, samples are converted on
+  // their way in and out of the rings, with pacers that carry no data keeping
+  // count of the frames on the host side
+  uint32_t host_rate, rate;
+  struct resampler resampler[2];
+  size_t n_states;
+  struct resample_state *states, pacer[2];
+  float *scratch;
+};
+
+// outputs of cycles the host finishes past their deadline are replaced with
+// the last good block, faded out or repeated once, and silence after that
+enum watchdog_mode {
+  WATCHDOG_OFF,
+  WATCHDOG_FADE,
+  WATCHDOG_REPEAT,
+  N_WATCHDOGS,
+};
+extern const char *const watchdog_names[N_WATCHDOGS];
+struct watchdog {
+  enum watchdog_mode mode;
+  size_t len, misses;
+  float *last;
+  atomic_uint_fast64_t overruns, worst; // ns
+};
+
+// time the host takes per call against the time its block lasts, kept for
+// policies that react to sustained load from outside the data thread
+struct load {
+  bool on;
+  atomic_uint_fast64_t overruns;
+  atomic_uint peak; // per mille, highest since last taken
+};
+
+// the last cycles, in a ring only the data thread writes to, that freezes
+// after a cycle that overran its deadline or didn't follow on from the one
+// before, until it has been dumped from elsewhere
+enum flight_flags {
+  FLIGHT_OVERRUN = 1 << 0,
+  FLIGHT_DISCONT = 1 << 1,
+};
+struct flight_event {
+  uint64_t nsec, next_nsec; // graph cycle start and deadline
+  // CLOCK_MONOTONIC when the cycle was picked up and around the host calls
+  // made in it, which are zero when there were none
+  uint64_t wakeup, start, end;
+  uint64_t position;
+  double rate_diff;
+  uint32_t duration;
+  uint16_t idx, flags;
+};
+struct flight {
+  size_t mask, head;
+  struct flight_event *events, cycle;
+  bool recording; // this cycle
+  atomic_bool frozen;
+};
+
+// round trip measurement, a click put on one host output once the host is
+// done with it and looked for on one host input before the host gets it, so
+// that the result counts everything between the two in host frames
+enum probe_state {
+  PROBE_IDLE,
+  PROBE_ARMED,
+  PROBE_SENT,
+  PROBE_DONE,
+  PROBE_FAILED,
+};
+#define PROBE_THRESHOLD 0.1f // -20 dBFS
+struct probe {
+  atomic_int state;
+  size_t out, in; // into the channel list
+  uint64_t sent;
+  atomic_size_t frames;
+};
+
+// audio nodes and their ports as the registry announces them, sorted by id
+// and index, with the filter's ports under a node of their own that names
+// them after their targets and links them to those once they show up
+struct port {
+  size_t idx;
+  uint32_t id;
+  char name[MAX_STR];
+  struct port *next;
+
+  // only used for filter ports, which live under the unknown node
+  uint32_t peer;
+  void *link;
+};
+struct node {
+  uint32_t id;
+  char name[MAX_STR], display[MAX_STR];
+  struct port *ports[2];
+  struct node *next;
+};
+struct graph {
+  struct node *nodes, *unknown;
+};
+
+// what hosts get told about each channel, indexed once per port configuration
+// since they query it channel by channel
+struct table {
+  size_t len;
+  struct entry {
+    char name[MAX_CHANNEL_NAME];
+    bool active;
+  } *entries;
+};
+
+// what the engine needs from the graph and the host, which the driver backs
+// with the filter and ASIO callbacks and benchmarks with fakes
+struct engine_ops {
+  struct pw_buffer *(*dequeue)(void *data, void *port);
+  void (*queue)(void *data, void *port, struct pw_buffer *buf);
+  // calls the host on one half with the time of its first frame
+  void (*swap)(void *data, size_t idx, uint64_t pos, uint64_t time,
+               uint32_t rate);
+  // nanoseconds from CLOCK_MONOTONIC to the host clock
+  int64_t (*host_offset)(void *data);
+  // optional, called whenever the graph quantum or rate changes
+  void (*reschedule)(void *data, size_t duration, uint32_t rate);
+  // optional, called when the flight recorder freezes, to have it dumped
+  void (*frozen)(void *data);
+  // optional, links a filter port to the port id of its target in the
+  // direction of the target, returning what unlink takes or nullptr
+  void *(*link)(void *data, const struct port *target, enum pw_direction dir,
+                uint32_t id);
+  void (*unlink)(void *data, void *link);
+  // optional, drops the filter port of a channel the host no longer uses
+  void (*remove_port)(void *data, const struct channel *channel);
+};
+
+struct engine {
+  const struct engine_ops *ops;
+  void *data;
+
+  struct graph graph;
+
+  size_t n_channels;
+  struct channel *channels;
+
+  size_t idx;
+  struct clock clock;
+  struct dll dll;
+  uint32_t clock_id;
+  uint64_t pos_offset, next_pos;
+  size_t duration;
+  uint32_t rate;
+
+  // each slot of the arena holds both halves of a channel, followed by the
+  // host's own halves when reblocking
+  int fd;
+  size_t maxsize, blocksize, n_slots;
+  float *buffer;
+  struct reblock reblock;
+  struct watchdog watchdog;
+  bool sanitize;
+  struct load load;
+  struct probe probe;
+  struct flight flight;
+
+  // the data loop runs for as long as there are buffers, this only tells
+  // whether the host is being called
+  atomic_bool running;
+};
+
+size_t engine_arena_size(const struct engine *engine, size_t n_slots);
+// the first two buffers of a channel back its halves of the arena, returns
+// false for any further ones
+bool engine_add_buffer(struct engine *engine, size_t idx,
+                       struct pw_buffer *buf);
+void engine_remove_buffer(struct engine *engine, size_t idx,
+                          struct pw_buffer *buf);
+// a whole graph cycle, on the data thread
+void engine_process(struct engine *engine, struct spa_io_position *pos);
+struct snapshot engine_read_clock(const struct clock *clock);
+// arms a measurement from output to input, by their ASIO channel numbers,
+// false if one is still going or the host isn't running
+bool engine_probe(struct engine *engine, size_t out, size_t in);
+
+// sizes the rings for the channels in place and block frames on the host
+// side, converting rates when the host rate differs from graph_rate
+int engine_setup_reblock(struct engine *engine, size_t block,
+                         uint32_t graph_rate, enum resample_quality quality);
+void engine_clear_reblock(struct reblock *rb);
+
+// keeps at least n_events cycles, before the data loop starts
+int engine_setup_flight(struct engine *engine, size_t n_events);
+void engine_clear_flight(struct flight *flight);
+// writes a frozen ring out as CSV, oldest cycle first, and thaws it
+int engine_dump_flight(struct flight *flight, FILE *file);
+
+// port configuration is kept as registry style multi-strings
+size_t engine_count_ports(const char *ports);
+size_t engine_sizeof_ports(const char *ports);
+const char *engine_get_port(const char *ports, size_t idx);
+
+// channels are named after the display name of their target node and the
+// port, the former cut short so that the port always shows
+void engine_name_channels(const struct graph *graph, const char *ports,
+                          struct table *table);
+int engine_build_table(const struct graph *graph, const char *ports,
+                       struct table *table);
+void engine_activate(struct table *table, bool active);
+// nullptr for channels past either end
+const struct entry *engine_entry(const struct table *table, long idx);
+
+// the graph starts out with just the node for the filter's ports
+int engine_init_graph(struct graph *graph);
+void engine_clear_graph(struct graph *graph);
+struct node *engine_find_node(const struct graph *graph, uint32_t id);
+int engine_add_node(struct graph *graph, uint32_t id, const char *name,
+                    const char *display);
+// ports of the filter go to graph.unknown under their target's name and in
+// its direction, and get linked to it, other ones link any waiting for them
+int engine_add_port(struct engine *engine, struct node *node,
+                    enum pw_direction dir, uint32_t id, size_t idx,
+                    const char *name);
+// a node with its ports, or a single port, unlinking what pointed to them
+void engine_remove_global(struct engine *engine, uint32_t id);
+// points the filter ports of channels in dir to a new set of targets with
+// the same channel count, relinking those that changed
+void engine_retarget(struct engine *engine, enum pw_direction dir,
+                     const char *ports);
+
+// swaps in channels, listed by direction and index only, keeping the ports
+// and arena slots of the ones still in use and dropping the others, then
+// grows the arena for new ones, which are left without a port; channels are
+// taken over either way
+int engine_setup_channels(struct engine *engine, struct channel *channels,
+                          size_t n_channels);
+
+#endif // !__PWASIO_ENGINE_H__
@@ -27,15 +27,28 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "pwasio.h"
 #include "asio.h"
+#include "engine.h"
+#include "resample.h"
 #include "resource.h"
+#include "rtkit.h"
+#include "wav.h"
 
+#include <alloca.h>
+#include <fcntl.h>
+#include <math.h>
 #include <pipewire/pipewire.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sched.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <xmmintrin.h>
+#endif
 
 #include <commctrl.h>
 #include <shlwapi.h>
@@ -43,11 +56,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <pipewire/extensions/metadata.h>
 #include <spa/param/audio/format-utils.h>
+#include <spa/param/latency-utils.h>
 #include <spa/utils/json.h>
 
 WINE_DEFAULT_DEBUG_CHANNEL(pwasio);
 
-#define MAX_STR 1024
+static_assert(MAX_CHANNEL_NAME == ASIO_MAX_NAME);
 
 #define pwasio_err(code, msg, ...)                                             \
   do {                                                                         \
@@ -61,6 +75,25 @@ WINE_DEFAULT_DEBUG_CHANNEL(pwasio);
 #define KEY_SMPRATE "sample_rate"
 #define KEY_PRIORITY "priority"
 #define KEY_HOST_PRIORITY "host_priority"
+#define KEY_CPUS "cpus"
+#define KEY_HOST_CPUS "host_cpus"
+#define KEY_STACK "stack_prefault"
+#define KEY_DEADLINE "deadline"
+#define KEY_DMA_LATENCY "dma_latency"
+#define KEY_GOVERNOR "governor"
+#define KEY_ASYNC "async"
+#define KEY_REBLOCK "reblock"
+#define KEY_RESAMPLE "resample"
+#define KEY_WATCHDOG "watchdog"
+#define KEY_SANITIZE "sanitize"
+#define KEY_PLUGIN_DELAY "plugin_delay"
+#define KEY_LATENCY_CORRECTION "latency_correction"
+#define KEY_ADAPTIVE "adaptive"
+#define KEY_BACKEND "backend"
+#define KEY_WAV_INPUT "wav_input"
+#define KEY_WAV_OUTPUT "wav_output"
+#define KEY_FLIGHT "flight_recorder"
+#define KEY_FLIGHT_DIR "flight_dir"
 #define KEY_INPUTS "inputs"
 #define KEY_OUTPUTS "outputs"
 
@@ -68,26 +101,271 @@ WINE_DEFAULT_DEBUG_CHANNEL(pwasio);
 #define DEFAULT_SMPRATE 48000
 #define DEFAULT_AUTOCON 1
 #define DEFAULT_PRIORITY 0
+#define DEFAULT_STACK 64
+// a quarter of the 1 MiB Wine gives its threads, host ones included
+#define MAX_STACK 256
+#define DEFAULT_DEADLINE 0
+#define DEFAULT_DMA_LATENCY -1
+#define DEFAULT_ASYNC false
+#define DEFAULT_REBLOCK false
+#define DEFAULT_RESAMPLE RESAMPLE_OFF
+#define DEFAULT_WATCHDOG WATCHDOG_OFF
+#define DEFAULT_SANITIZE false
+#define DEFAULT_PLUGIN_DELAY 0
+#define DEFAULT_LATENCY_CORRECTION 0
+#define DEFAULT_ADAPTIVE 0
+#define DEFAULT_BACKEND BACKEND_PIPEWIRE
+#define DEFAULT_FLIGHT 0
+#define DEFAULT_FLIGHT_DIR "/tmp"
+// a host that keeps overrunning would otherwise fill the disk
+#define MAX_FLIGHT_DUMPS 16
 static const char dummy_port[] = "dummy:port\0";
 
 #define PWASIO_TARGET "ASIO:target:"
 
+#define DEFAULT_GROUP "group.dsp.0"
+// joining the group of the freewheel driver is what JACK clients do too
+#define FREEWHEEL_GROUP "pipewire.freewheel"
+
+#ifndef PW_KEY_NODE_ASYNC
+#define PW_KEY_NODE_ASYNC "node.async"
+#endif
+
+#define MAX_PROMOTED 16
+
+// cpu lists use the same format as taskset, e.g. 2,4-7
+static bool _parse_cpus(const char *str, cpu_set_t *cpus) {
+  CPU_ZERO(cpus);
+  for (const char *p = str; *p;) {
+    char *end;
+    unsigned long lo = strtoul(p, &end, 10), hi = lo;
+    if (end == p)
+      return false;
+    if (*end == '-') {
+      p = end + 1;
+      hi = strtoul(p, &end, 10);
+      if (end == p || hi < lo)
+        return false;
+    }
+    if (hi >= CPU_SETSIZE)
+      return false;
+    for (; lo <= hi; lo++)
+      CPU_SET(lo, cpus);
+    if (*(p = end) == ',')
+      p++;
+    else if (*p)
+      return false;
+  }
+  return true;
+}
+// checks whether any of the given cpus services more than its share of device
+// interrupts according to /proc/interrupts, listing them in msg
+static bool _check_irqs(const cpu_set_t *cpus, char *msg, size_t len) {
+  FILE *f;
+  if (!CPU_COUNT(cpus) || !(f = fopen("/proc/interrupts", "r")))
+    return false;
+
+  char *line = nullptr;
+  size_t n = 0, n_cpus = 0;
+  int ids[CPU_SETSIZE];
+  unsigned long long counts[CPU_SETSIZE] = {}, total = 0;
+  if (getline(&line, &n, f) > 0) {
+    char *save;
+    for (char *t = strtok_r(line, " \t\n", &save); t && n_cpus < CPU_SETSIZE;
+         t = strtok_r(nullptr, " \t\n", &save))
+      if (sscanf(t, "CPU%d", &ids[n_cpus]) == 1)
+        n_cpus++;
+  }
+  while (getline(&line, &n, f) > 0) {
+    char *p = line, *end;
+    // numbered lines are device interrupts, the rest are per cpu counters
+    strtoul(p, &end, 10);
+    if (end == p || *end != ':')
+      continue;
+    p = end + 1;
+    for (size_t i = 0; i < n_cpus; i++, p = end) {
+      unsigned long long count = strtoull(p, &end, 10);
+      if (end == p)
+        break;
+      counts[i] += count;
+      total += count;
+    }
+  }
+  free(line);
+  fclose(f);
+
+  bool shared = false;
+  *msg = '\0';
+  for (size_t i = 0; i < n_cpus; i++)
+    if (CPU_ISSET(ids[i], cpus) && counts[i] * n_cpus > total) {
+      size_t l = strlen(msg);
+      snprintf(msg + l, len - l, "%s%d", shared ? ", " : "cpu ", ids[i]);
+      shared = true;
+    }
+  if (shared) {
+    size_t l = strlen(msg);
+    snprintf(msg + l, len - l, " handle%s many device interrupts",
+             strchr(msg, ',') ? "" : "s");
+  }
+  return shared;
+}
+// only for threads that run nothing but audio, as it changes floating point
+// results for everything else on the thread
+static void _flush_denormals(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_setcsr(_mm_getcsr() | 0x8040); // FTZ | DAZ
+#elif defined(__aarch64__)
+  uint64_t fpcr;
+  __asm__ volatile("mrs %0, fpcr" : "=r"(fpcr));
+  __asm__ volatile("msr fpcr, %0" : : "r"(fpcr | (1 << 24))); // FZ
+#endif
+}
+// gets the calling thread ready for realtime work, faulting in the given
+// amount of stack and asking for minimal timer slack
+static void _harden(size_t stack) {
+  if (stack) {
+    volatile char *p = alloca(stack);
+    for (size_t i = 0; i < stack; i += getpagesize())
+      p[i] = 0;
+  }
+  if (prctl(PR_SET_TIMERSLACK, 1))
+    WINE_WARN("unable to set timer slack: %s\n", strerror(errno));
+}
+static void _pin(pthread_t tid, const cpu_set_t *cpus, const char *role) {
+  if (!CPU_COUNT(cpus))
+    return;
+  WINE_TRACE("pinning %s to %d cpus\n", role, CPU_COUNT(cpus));
+  int err;
+  if ((err = pthread_setaffinity_np(tid, sizeof *cpus, cpus)))
+    WINE_ERR("unable to set %s affinity: %s\n", role, strerror(err));
+}
+
+// power management requests held while the engine runs, so that short quanta
+// don't pay for deep C-state exits or frequency ramps
+struct qos {
+  int latency; // us, < 0 to leave the PM QoS alone
+  char governor[MAX_STR];
+  int fd;
+  enum { QOS_IDLE, QOS_GRANTED, QOS_DENIED } status;
+
+  // governors found on each cpu before they were overridden
+  size_t n_cpus;
+  char (*saved)[32];
+};
+static bool _set_governor(size_t cpu, const char *governor, char *old,
+                          size_t len) {
+  char path[64];
+  snprintf(path, sizeof path,
+           "/sys/devices/system/cpu/cpu%zu/cpufreq/scaling_governor", cpu);
+  FILE *f;
+  if (!(f = fopen(path, "r+")))
+    return false;
+  bool res = false;
+  if (old && !fgets(old, len, f))
+    goto cleanup;
+  if (old)
+    old[strcspn(old, "\n")] = '\0';
+  rewind(f);
+  res = fputs(governor, f) >= 0;
+cleanup:
+  return !fclose(f) && res;
+}
+static void _qos_acquire(struct qos *qos, const cpu_set_t *cpus) {
+  bool granted = true;
+  if (qos->latency >= 0 && qos->fd < 0) {
+    // the request only lasts as long as the file stays open
+    int32_t latency = qos->latency;
+    if ((qos->fd = open("/dev/cpu_dma_latency", O_WRONLY | O_CLOEXEC)) < 0 ||
+        write(qos->fd, &latency, sizeof latency) != sizeof latency) {
+      WINE_WARN("unable to request %d us wake latency: %s\n", latency,
+                strerror(errno));
+      if (qos->fd >= 0)
+        close(qos->fd);
+      qos->fd = -1;
+      granted = false;
+    } else
+      WINE_TRACE("requested %d us wake latency\n", latency);
+  }
+  if (*qos->governor && !qos->saved) {
+    qos->n_cpus = SPA_MIN(sysconf(_SC_NPROCESSORS_CONF), CPU_SETSIZE);
+    if ((qos->saved = calloc(qos->n_cpus, sizeof *qos->saved)))
+      for (size_t i = 0; i < qos->n_cpus; i++) {
+        if (CPU_COUNT(cpus) && !CPU_ISSET(i, cpus))
+          continue;
+        if (!_set_governor(i, qos->governor, qos->saved[i],
+                           sizeof qos->saved[i])) {
+          WINE_WARN("unable to set cpu %zu governor to %s\n", i,
+                    qos->governor);
+          *qos->saved[i] = '\0';
+          granted = false;
+        }
+      }
+    else
+      granted = false;
+  }
+  if (qos->latency >= 0 || *qos->governor)
+    qos->status = granted ? QOS_GRANTED : QOS_DENIED;
+}
+static void _qos_release(struct qos *qos) {
+  if (qos->fd >= 0) {
+    WINE_TRACE("releasing wake latency request\n");
+    close(qos->fd);
+    qos->fd = -1;
+  }
+  if (qos->saved) {
+    for (size_t i = 0; i < qos->n_cpus; i++)
+      if (*qos->saved[i] &&
+          !_set_governor(i, qos->saved[i], nullptr, 0))
+        WINE_WARN("unable to restore cpu %zu governor\n", i);
+    free(qos->saved);
+    qos->saved = nullptr;
+  }
+}
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
+// not every libc exposes sched_setattr, so we bring our own
+struct deadline_attr {
+  uint32_t size, policy;
+  uint64_t flags;
+  int32_t nice;
+  uint32_t priority;
+  uint64_t runtime, deadline, period;
+};
+
 struct thread {
   HANDLE handle;
   DWORD thread_id;
   pthread_t tid;
+  pid_t pid;
   int priority;
-  atomic_bool ready;
+  cpu_set_t cpus;
+  size_t stack;
+  HANDLE ready;
+  struct rtkit *rtkit;
+
+  // SCHED_DEADLINE gets a runtime of budget percent of the period, which is
+  // recomputed whenever the graph quantum changes, and SCHED_FIFO at priority
+  // once the kernel has refused it
+  unsigned budget;
+  bool refused;
+  size_t duration, rate;
 
   void *(*start)(void *);
   void *arg, *ret;
 };
 
-// TODO: use a signal
 static DWORD WINAPI _thread_func(LPVOID p) {
   struct thread *t = p;
   t->tid = pthread_self();
-  atomic_store_explicit(&t->ready, true, memory_order_release);
+  t->pid = gettid();
+  _flush_denormals();
+  _harden(t->stack);
+  SetEvent(t->ready);
   t->ret = t->start(t->arg);
   return 0;
 }
@@ -97,14 +375,14 @@ static struct spa_thread *_create(void *_data, const struct spa_dict *,
 
   t->start = start;
   t->arg = arg;
-  t->handle = CreateThread(nullptr, 0, _thread_func, t, 0, &t->thread_id);
-  if (!t->handle)
+  if (!(t->ready = CreateEvent(nullptr, false, false, nullptr)))
     return nullptr;
+  t->handle = CreateThread(nullptr, 0, _thread_func, t, 0, &t->thread_id);
+  if (t->handle)
+    WaitForSingleObject(t->ready, INFINITE);
+  CloseHandle(t->ready);
 
-  while (!atomic_load_explicit(&t->ready, memory_order_acquire))
-    sched_yield();
-
-  return (struct spa_thread *)t->tid;
+  return t->handle ? (struct spa_thread *)t->tid : nullptr;
 }
 static int _join(void *_data, struct spa_thread *, void **retval) {
   struct thread *t = _data;
@@ -123,22 +401,64 @@ static int _get_rt_range(void *, const struct spa_dict *, int *min, int *max) {
   *max = THREAD_PRIORITY_TIME_CRITICAL;
   return 0;
 }
-static int _acquire_rt(void *_data, struct spa_thread *, int priority) {
-  struct thread *t = _data;
-  int err = 0;
-  if (t->priority && priority == -1) {
-    WINE_TRACE("setting driver scheduler to SCHED_FIFO with priority %d\n",
-               t->priority);
-    if ((err = pthread_setschedparam(
-             t->tid, SCHED_FIFO,
-             &(struct sched_param){.sched_priority = t->priority})))
-      WINE_ERR("%s\n", strerror(err));
+static int _schedule(struct thread *t, size_t duration, size_t rate) {
+  t->duration = duration;
+  t->rate = rate;
+  uint64_t period = duration * SPA_NSEC_PER_SEC / rate;
+  struct deadline_attr attr = {
+      .size = sizeof attr,
+      .policy = SCHED_DEADLINE,
+      .flags = SCHED_FLAG_RESET_ON_FORK,
+      .runtime = period * t->budget / 100,
+      .deadline = period,
+      .period = period,
+  };
+  WINE_TRACE("setting driver scheduler to SCHED_DEADLINE with runtime %lu "
+             "over %lu ns\n",
+             attr.runtime, attr.period);
+  if (syscall(SYS_sched_setattr, t->pid, &attr, 0)) {
+    WINE_ERR("%s\n", strerror(errno));
+    return errno;
   }
+  return 0;
+}
+static int _fifo(struct thread *t) {
+  if (!t->priority)
+    return 0;
+  WINE_TRACE("setting driver scheduler to SCHED_FIFO with priority %d\n",
+             t->priority);
+  int err;
+  if (t->rtkit)
+    err = -rtkit_make_realtime(t->rtkit, t->pid, t->priority);
+  else if ((err = pthread_setschedparam(
+                t->tid, SCHED_FIFO,
+                &(struct sched_param){.sched_priority = t->priority})))
+    WINE_ERR("%s\n", strerror(err));
   return err;
 }
+// SCHED_DEADLINE needs CAP_SYS_NICE, which neither RLIMIT_RTPRIO nor RTKit
+// grant, so the thread falls back to SCHED_FIFO rather than run unscheduled
+static int _deadline(struct thread *t, size_t duration, size_t rate) {
+  if (t->refused)
+    return _fifo(t);
+  int err;
+  if (!(err = _schedule(t, duration, rate)))
+    return 0;
+  WINE_WARN("SCHED_DEADLINE refused (%s), falling back to SCHED_FIFO\n",
+            strerror(err));
+  t->refused = true;
+  return _fifo(t);
+}
+static int _acquire_rt(void *_data, struct spa_thread *, int priority) {
+  struct thread *t = _data;
+  if (priority != -1)
+    return 0;
+  _pin(t->tid, &t->cpus, "driver");
+  return t->budget ? _deadline(t, t->duration, t->rate) : _fifo(t);
+}
 static int _drop_rt(void *_data, struct spa_thread *) {
   struct thread *t = _data;
-  if (t->priority) {
+  if (t->priority || t->budget) {
     WINE_TRACE("setting driver scheduler to SCHED_OTHER\n");
     int err;
     if ((err = pthread_setschedparam(
@@ -155,85 +475,48 @@ static const struct spa_thread_utils_methods thread_utils_methods = {
     .drop_rt = _drop_rt,
 };
 
-struct channel {
-  size_t *port, idx;
-  enum pw_direction dir;
-  size_t offset[2];
-  struct pw_buffer *buffer[2];
+// the internal backends stand in for the graph without a daemon, cycling the
+// same arena either on a timer or back to back
+enum backend { BACKEND_PIPEWIRE, BACKEND_TIMER, BACKEND_FREERUN, N_BACKENDS };
+static const char *const backend_names[N_BACKENDS] = {"pipewire", "timer",
+                                                      "freerun"};
+struct internal {
+  enum backend backend;
+  struct pw_loop *loop;
+  struct spa_source *source;
+  struct spa_io_position position;
+  // cycle times follow from the position reached since the last start
+  uint64_t start, base;
+  struct wav wav[2];
+  float *frames;
 };
-struct engine {
-  size_t n_channels;
-  struct channel *channels;
 
-  size_t idx, pos, nsec;
-
-  int fd;
-  size_t maxsize;
-  float *buffer;
-
-  bool running;
-
-  struct asio_callbacks *callbacks;
+// the buffer size is doubled after a window with enough host calls that took
+// longer than their block lasts, and halved back towards the configured one
+// after a long enough stretch of windows with plenty of headroom
+#define ADAPT_WINDOW_MS 2000
+#define ADAPT_HEADROOM 250 // per mille
+#define ADAPT_CALM 15      // windows
+// what the last instance adapted to, which outlives it when the host resets
+static atomic_size_t adapted;
+struct adapt {
+  size_t threshold, base, max, calm;
+  uint64_t overruns;
+  // hosts that can't change buffer sizes in place get reset instead
+  bool reset;
+  HANDLE thread, stop;
+  DWORD thread_id;
 };
+
 static void _add_buffer(void *_data, void *_port, struct pw_buffer *buf) {
-  struct engine *engine = _data;
-  struct channel *channel = &engine->channels[*(size_t *)_port];
-
-  struct spa_data *data = &buf->buffer->datas[0];
-  if (!channel->buffer[0]) {
-    channel->buffer[0] = buf;
-    data->mapoffset = channel->offset[0];
-  } else if (!channel->buffer[1]) {
-    channel->buffer[1] = buf;
-    data->mapoffset = channel->offset[1];
-  } else {
+  if (!engine_add_buffer(_data, *(size_t *)_port, buf))
     WINE_WARN("extra buffer\n");
-    return;
-  }
-  data->type = SPA_DATA_MemFd;
-  data->flags = SPA_DATA_FLAG_READWRITE | SPA_DATA_FLAG_MAPPABLE;
-  data->fd = engine->fd;
-  data->maxsize = engine->maxsize * sizeof(float);
 }
 static void _remove_buffer(void *_data, void *_port, struct pw_buffer *buf) {
-  struct engine *engine = _data;
-  struct channel *channel = &engine->channels[*(size_t *)_port];
-
-  if (buf == channel->buffer[0])
-    channel->buffer[0] = nullptr;
-  if (buf == channel->buffer[1])
-    channel->buffer[1] = nullptr;
+  engine_remove_buffer(_data, *(size_t *)_port, buf);
 }
 static void _process(void *_data, struct spa_io_position *pos) {
-  struct engine *engine = _data;
-
-  engine->pos = pos->clock.position;
-  engine->nsec = pos->clock.nsec;
-
-  for (size_t i = 0; i < engine->n_channels; i++) {
-    struct channel channel = engine->channels[i];
-    if (SPA_LIKELY(channel.port))
-      pw_filter_dequeue_buffer(channel.port);
-  }
-
-  engine->callbacks->swap_buffers(engine->idx, false);
-
-  struct pw_buffer *buf;
-  for (size_t i = 0; i < engine->n_channels; i++) {
-    struct channel channel = engine->channels[i];
-    if (SPA_LIKELY(buf = channel.buffer[engine->idx])) {
-      if (channel.dir != PW_DIRECTION_INPUT) {
-        struct spa_data *d = &buf->buffer->datas[0];
-        d->chunk->offset = 0;
-        d->chunk->size = pos->clock.duration * sizeof(float);
-        d->chunk->stride = sizeof(float);
-        d->chunk->flags = 0;
-      }
-      pw_filter_queue_buffer(channel.port, buf);
-    }
-  }
-
-  engine->idx = !engine->idx;
+  engine_process(_data, pos);
 }
 static const struct pw_filter_events filter_events = {
     PW_VERSION_FILTER_EVENTS,
@@ -242,19 +525,6 @@ static const struct pw_filter_events filter_events = {
     .process = _process,
 };
 
-struct node {
-  uint32_t id;
-  char name[MAX_STR], display[MAX_STR];
-  struct port *ports[2];
-  struct node *next;
-};
-struct port {
-  size_t idx;
-  uint32_t id;
-  char name[MAX_STR];
-  struct port *next;
-};
-
 struct context {
   struct pw_thread_loop *th_loop;
   struct pw_context *context;
@@ -269,7 +539,6 @@ struct context {
   struct pw_filter *filter;
 
   struct path *paths;
-  struct node *nodes, *unknown;
 
   struct pw_module *realtime;
   struct pw_metadata *settings, *defaults;
@@ -284,21 +553,341 @@ struct pwasio {
 
   struct context context;
 
-  size_t buffer_size, sample_rate;
+  // changed from the adaptation thread while the host reads it
+  atomic_size_t buffer_size;
+  size_t sample_rate, graph_rate;
+  bool async, reblock;
+  // what the filter properties were made from, see _filter_stale
+  struct filter_config {
+    size_t buffer_size, sample_rate, graph_rate;
+    bool async, reblock;
+  } filter_config;
+  enum resample_quality resample;
+  enum watchdog_mode watchdog;
+  bool sanitize;
+  size_t plugin_delay;
+  LONG latency_correction; // measured round trip past the reported one
+  atomic_bool freewheel;
+  enum backend backend;
+  char wav[2][MAX_STR];
+  size_t flight; // seconds
+  char flight_dir[MAX_STR];
+  size_t n_dumps;
   char *ports[2];
+  // host calls read the port lists unlocked, so the ones a retarget replaces
+  // are only freed on Release
+  char **retired;
+  size_t n_retired;
+  struct table table[2];
 
-  pthread_t host_tid, audio_tid;
   int host_priority;
+  cpu_set_t host_cpus;
+  char cpus[2][MAX_STR];
   struct spa_thread_utils thread_utils;
   struct thread thread;
+  struct rtkit rtkit;
+  struct qos qos;
+
+  // host threads are promoted once per role and instance, see _promote
+  uint64_t serial;
+  atomic_size_t n_promoted;
+  struct promoted {
+    pid_t pid;
+    uint64_t start; // tells a reused thread id apart
+  } promoted[MAX_PROMOTED];
 
   struct engine engine;
+  struct internal internal;
+  struct adapt adapt;
+  LARGE_INTEGER qpc_freq;
+  struct asio_callbacks *callbacks;
+  // handed to hosts that ask for time info along with the buffer switch
+  bool time_info;
+  struct asio_time time;
 
   HINSTANCE hinst;
   HANDLE panel;
   _Atomic HWND dialog;
 };
 
+// the engine sees the filter and host through these
+static struct pw_buffer *_dequeue(void *, void *port) {
+  return pw_filter_dequeue_buffer(port);
+}
+static void _queue(void *, void *port, struct pw_buffer *buf) {
+  pw_filter_queue_buffer(port, buf);
+}
+static void _swap(void *_data, size_t idx, uint64_t pos, uint64_t time,
+                  uint32_t rate) {
+  struct pwasio *pwasio = _data;
+  if (pwasio->time_info) {
+    pwasio->time.info = (struct asio_time_info){
+        .speed = 1.0,
+        .sys_time = {.lo = time, .hi = time >> 32},
+        .sample_pos = {.lo = pos, .hi = pos >> 32},
+        .sample_rate = rate,
+        .flags = ASIO_TIME_INFO_SYSTEM_TIME_VALID |
+                 ASIO_TIME_INFO_SAMPLE_POSITION_VALID |
+                 ASIO_TIME_INFO_SAMPLE_RATE_VALID,
+    };
+    pwasio->callbacks->swap_buffers_time_info(&pwasio->time, idx, false);
+  } else
+    pwasio->callbacks->swap_buffers(idx, false);
+}
+static int64_t _host_offset(void *_data) {
+  LONGLONG freq = ((struct pwasio *)_data)->qpc_freq.QuadPart;
+  struct timespec ts;
+  LARGE_INTEGER qpc;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  QueryPerformanceCounter(&qpc);
+  int64_t host = qpc.QuadPart / freq * SPA_NSEC_PER_SEC +
+                 qpc.QuadPart % freq * SPA_NSEC_PER_SEC / freq;
+  return host - SPA_TIMESPEC_TO_NSEC(&ts);
+}
+static void _reschedule(void *_data, size_t duration, uint32_t rate) {
+  struct thread *t = &((struct pwasio *)_data)->thread;
+  if (t->budget && !t->refused &&
+      (duration != t->duration || rate != t->rate))
+    _deadline(t, duration, rate);
+}
+// files are written from the thread loop, the data thread keeps going with
+// the recorder frozen until then
+static int _dump_flight(struct spa_loop *, bool, uint32_t, const void *,
+                        size_t, void *_data) {
+  struct pwasio *pwasio = _data;
+  struct flight *flight = &pwasio->engine.flight;
+  if (!flight->events ||
+      !atomic_load_explicit(&flight->frozen, memory_order_acquire))
+    return 0;
+  if (pwasio->n_dumps >= MAX_FLIGHT_DUMPS) {
+    if (pwasio->n_dumps++ == MAX_FLIGHT_DUMPS)
+      WINE_WARN("flight recorder stopped after %u dumps\n", MAX_FLIGHT_DUMPS);
+    return 0;
+  }
+  char path[MAX_STR + 64];
+  snprintf(path, sizeof path, "%s/pwasio-%d-%zu.csv", pwasio->flight_dir,
+           getpid(), pwasio->n_dumps++);
+  FILE *f = fopen(path, "w");
+  int res = f ? engine_dump_flight(flight, f) : -errno;
+  if (f && fclose(f) && res >= 0)
+    res = -errno;
+  if (res < 0) {
+    WINE_ERR("failed to write flight recorder to %s: %s\n", path,
+             strerror(-res));
+    // keeps recording even when the file can't be written
+    atomic_store_explicit(&flight->frozen, false, memory_order_release);
+  } else
+    WINE_WARN("overrun or discontinuity, flight recorder written to %s\n",
+              path);
+  return 0;
+}
+static void _frozen(void *_data) {
+  struct pwasio *pwasio = _data;
+  pw_loop_invoke(pw_thread_loop_get_loop(pwasio->context.th_loop),
+                 _dump_flight, 0, nullptr, 0, false, pwasio);
+}
+// filter ports are kept with the direction of their target, so that unresolved
+// targets show up in the patchbay alongside regular ports
+static void *_link(void *_data, const struct port *target,
+                   enum pw_direction dir, uint32_t id) {
+  struct pwasio *pwasio = _data;
+  struct pw_properties *props;
+  if (!(props = pw_properties_new(nullptr, nullptr)))
+    return nullptr;
+  if (dir == PW_DIRECTION_OUTPUT) {
+    pw_properties_setf(props, PW_KEY_LINK_OUTPUT_PORT, "%u", id);
+    pw_properties_setf(props, PW_KEY_LINK_INPUT_PORT, "%u", target->id);
+  } else {
+    pw_properties_setf(props, PW_KEY_LINK_OUTPUT_PORT, "%u", target->id);
+    pw_properties_setf(props, PW_KEY_LINK_INPUT_PORT, "%u", id);
+  }
+  WINE_TRACE("linking port %u to %s\n", target->id, target->name);
+  struct pw_proxy *link = pw_core_create_object(
+      pwasio->context.core, "link-factory", PW_TYPE_INTERFACE_Link,
+      PW_VERSION_LINK, &props->dict, 0);
+  pw_properties_free(props);
+  return link;
+}
+static void _unlink(void *, void *link) { pw_proxy_destroy(link); }
+static void _remove_port(void *, const struct channel *channel) {
+  WINE_TRACE("removing %s %lu\n",
+             channel->dir == PW_DIRECTION_INPUT ? "input" : "output",
+             channel->idx);
+  pw_filter_remove_port(channel->port);
+}
+static const struct engine_ops engine_ops = {
+    .dequeue = _dequeue,
+    .queue = _queue,
+    .swap = _swap,
+    .host_offset = _host_offset,
+    .reschedule = _reschedule,
+    .frozen = _frozen,
+    .link = _link,
+    .unlink = _unlink,
+    .remove_port = _remove_port,
+};
+
+// inputs come from a file or silence, and outputs go to a file if any, which
+// blocks the data thread but keeps offline runs exact
+static void _cycle(struct pwasio *pwasio, uint64_t nsec, uint64_t next_nsec) {
+  struct engine *engine = &pwasio->engine;
+  struct internal *in = &pwasio->internal;
+  struct spa_io_clock *clock = &in->position.clock;
+  size_t n = clock->duration, idx = engine->idx;
+  bool running = atomic_load_explicit(&engine->running, memory_order_acquire);
+
+  struct wav *wav = &in->wav[PW_DIRECTION_INPUT];
+  size_t len = wav->file ? wav_read(wav, in->frames, n) : 0;
+  for (size_t i = 0; i < engine->n_channels; i++) {
+    struct channel channel = engine->channels[i];
+    if (channel.dir != PW_DIRECTION_INPUT)
+      continue;
+    float *dst = engine->buffer + channel.host[idx] / sizeof(float);
+    size_t k = 0;
+    if (channel.idx < wav->channels)
+      for (; k < len; k++)
+        dst[k] = in->frames[k * wav->channels + channel.idx];
+    memset(dst + k, 0, (n - k) * sizeof(float));
+  }
+
+  clock->nsec = nsec;
+  clock->next_nsec = next_nsec;
+  engine_process(engine, &in->position);
+  clock->position += n;
+
+  wav = &in->wav[PW_DIRECTION_OUTPUT];
+  if (!wav->file || !running)
+    return;
+  memset(in->frames, 0, n * wav->channels * sizeof(float));
+  for (size_t i = 0; i < engine->n_channels; i++) {
+    struct channel channel = engine->channels[i];
+    if (channel.dir == PW_DIRECTION_INPUT || channel.idx >= wav->channels)
+      continue;
+    const float *src = engine->buffer + channel.host[idx] / sizeof(float);
+    for (size_t k = 0; k < n; k++)
+      in->frames[k * wav->channels + channel.idx] = src[k];
+  }
+  wav_write(wav, in->frames, n);
+}
+static uint64_t _cycle_time(const struct internal *in, uint64_t position) {
+  return in->start + (double)(position - in->base) * SPA_NSEC_PER_SEC /
+                         in->position.clock.rate.denom;
+}
+static void _on_timer(void *_data, uint64_t) {
+  struct pwasio *pwasio = _data;
+  struct internal *in = &pwasio->internal;
+  struct spa_io_clock *clock = &in->position.clock;
+
+  // cycles a slow host didn't leave time for are lost, as on a device
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = SPA_TIMESPEC_TO_NSEC(&ts), n = clock->duration;
+  if (SPA_UNLIKELY(now >= _cycle_time(in, clock->position + n))) {
+    double late = (now - _cycle_time(in, clock->position)) *
+                  (double)clock->rate.denom / SPA_NSEC_PER_SEC;
+    clock->position += (uint64_t)(late / n) * n;
+  }
+  uint64_t next = _cycle_time(in, clock->position + n);
+  _cycle(pwasio, _cycle_time(in, clock->position), next);
+
+  // absolute, so that rounded periods don't add up to a drift
+  struct timespec value = {
+      .tv_sec = next / SPA_NSEC_PER_SEC,
+      .tv_nsec = next % SPA_NSEC_PER_SEC,
+  };
+  pw_loop_update_timer(in->loop, in->source, &value, nullptr, true);
+}
+static void _on_idle(void *_data) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  _cycle(_data, SPA_TIMESPEC_TO_NSEC(&ts), 0);
+}
+// runs in the data loop, so that sources are only touched from its thread
+static int _arm(struct spa_loop *, bool, uint32_t, const void *data, size_t,
+                void *user_data) {
+  struct internal *in = &((struct pwasio *)user_data)->internal;
+  bool on = *(const bool *)data;
+  if (in->backend == BACKEND_FREERUN)
+    return pw_loop_enable_idle(in->loop, in->source, on);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  in->start = SPA_TIMESPEC_TO_NSEC(&ts);
+  in->base = in->position.clock.position;
+  return pw_loop_update_timer(in->loop, in->source, on ? &ts : nullptr,
+                              nullptr, true);
+}
+
+// in clock ticks since boot, 0 if the thread is gone
+static uint64_t _start_time(pid_t pid) {
+  char path[64], buf[1024];
+  snprintf(path, sizeof path, "/proc/self/task/%d/stat", pid);
+  FILE *f;
+  if (!(f = fopen(path, "r")))
+    return 0;
+  size_t len = fread(buf, 1, sizeof buf - 1, f);
+  fclose(f);
+  buf[len] = '\0';
+  // the name can hold anything, the state after it is the third field and
+  // the start time the 22nd
+  char *p = strrchr(buf, ')');
+  for (size_t i = 2; p && i < 22; i++)
+    p = strchr(p + 1, ' ');
+  return p ? strtoull(p + 1, nullptr, 10) : 0;
+}
+
+enum role { ROLE_HOST, ROLE_AUDIO, N_ROLES };
+static const char *const role_names[N_ROLES] = {"host", "audio"};
+static atomic_uint_fast64_t serials = 1;
+
+// brings the calling host thread up to the given priority the first time it
+// shows up in a role, later calls only cost a thread local comparison
+static void _promote(struct pwasio *pwasio, enum role role, int priority) {
+  static thread_local uint64_t promoted[N_ROLES];
+  if (SPA_LIKELY(promoted[role] == pwasio->serial))
+    return;
+  promoted[role] = pwasio->serial;
+
+  // the driver thread is already taken care of by _acquire_rt
+  pthread_t tid = pthread_self();
+  if (pthread_equal(tid, pwasio->thread.tid))
+    return;
+  const char *name = role_names[role];
+  _pin(tid, &pwasio->host_cpus, name);
+  if (!priority)
+    return;
+  // RTKit bounds RLIMIT_RTTIME for the whole process, which the thread the
+  // host initializes from, usually its GUI one, would run out of and get the
+  // host killed
+  if (role == ROLE_HOST && pwasio->rtkit.bus) {
+    WINE_TRACE("not promoting host thread through RTKit\n");
+    return;
+  }
+
+  WINE_TRACE("setting %s scheduler to SCHED_FIFO with priority %d\n", name,
+             priority);
+  pid_t pid = gettid();
+  int err;
+  if (pwasio->rtkit.bus)
+    err = -rtkit_make_realtime(&pwasio->rtkit, pid, priority);
+  else
+    err = pthread_setschedparam(
+        tid, SCHED_FIFO, &(struct sched_param){.sched_priority = priority});
+  if (err) {
+    WINE_ERR("unable to set %s realtime priority: %s\n", name, strerror(err));
+    return;
+  }
+  _harden(pwasio->thread.stack);
+  if (role == ROLE_AUDIO)
+    _flush_denormals();
+
+  size_t n = atomic_fetch_add(&pwasio->n_promoted, 1);
+  if (n < MAX_PROMOTED)
+    pwasio->promoted[n] = (struct promoted){pid, _start_time(pid)};
+  else
+    WINE_WARN("too many %s threads, %d will not be demoted\n", name, pid);
+}
+
 static void _done(void *_data, uint32_t id, int seq) {
   struct context *context = _data;
   if (id != PW_ID_CORE)
@@ -345,7 +934,7 @@ struct metadata {
   } type;
   union {
     struct {
-      size_t buffer_size, sample_rate;
+      size_t buffer_size, sample_rate, max_quantum;
     };
     char defaults[2][MAX_STR];
   };
@@ -360,6 +949,8 @@ int _property(void *_data, uint32_t, const char *key, const char *,
       metadata->sample_rate = pw_properties_parse_uint64(value);
     else if (spa_streq(key, "clock.quantum"))
       metadata->buffer_size = pw_properties_parse_uint64(value);
+    else if (spa_streq(key, "clock.max-quantum"))
+      metadata->max_quantum = pw_properties_parse_uint64(value);
   } else {
     if (spa_streq(key, "default.audio.source"))
       spa_json_str_object_find(value, strlen(value), "name",
@@ -379,7 +970,9 @@ static const struct pw_metadata_events metadata_events = {
 
 static void _global(void *_data, uint32_t id, uint32_t, const char *type,
                     uint32_t version, const struct spa_dict *props) {
-  struct context *context = _data;
+  struct pwasio *pwasio = _data;
+  struct context *context = &pwasio->context;
+  struct engine *engine = &pwasio->engine;
   const char *val;
   if (spa_streq(type, PW_TYPE_INTERFACE_Module)) {
     if (!(val = spa_dict_lookup(props, PW_KEY_MODULE_NAME)) ||
@@ -408,6 +1001,7 @@ static void _global(void *_data, uint32_t id, uint32_t, const char *type,
           .type = PWASIO_METADATA_SETTINGS,
           .buffer_size = DEFAULT_BUFSIZE,
           .sample_rate = DEFAULT_SMPRATE,
+          .max_quantum = MAX_QUANTUM,
       };
       pw_metadata_add_listener(context->settings, &settings->listener,
                                &metadata_events, settings);
@@ -446,28 +1040,14 @@ static void _global(void *_data, uint32_t id, uint32_t, const char *type,
     if (!audio || internal)
       return;
 
-    struct node *node, **root = &context->nodes;
-
-    if (!(node = malloc(sizeof *node)))
+    const char *name, *display;
+    if (!(name = spa_dict_lookup(props, PW_KEY_NODE_NAME)))
       return;
-    *node = (typeof(*node)){.id = id};
-    if (!(val = spa_dict_lookup(props, PW_KEY_NODE_NAME))) {
-      free(node);
-      return;
-    }
-    strncpy(node->name, val, sizeof node->name);
-    if ((val = spa_dict_lookup(props, PW_KEY_NODE_DESCRIPTION)))
-      strncpy(node->display, val, sizeof node->display);
-    else if ((val = spa_dict_lookup(props, PW_KEY_NODE_NICK)))
-      strncpy(node->display, val, sizeof node->display);
-    else
-      strncpy(node->display, node->name, sizeof node->display);
-
-    struct node **p = root;
-    while (*p && (*p)->id < id)
-      p = &(*p)->next;
-    node->next = *p;
-    *p = node;
+    if (!(display = spa_dict_lookup(props, PW_KEY_NODE_DESCRIPTION)) &&
+        !(display = spa_dict_lookup(props, PW_KEY_NODE_NICK)))
+      display = name;
+    if (engine_add_node(&engine->graph, id, name, display) < 0)
+      WINE_WARN("unable to keep track of node %u\n", id);
   } else if (spa_streq(type, PW_TYPE_INTERFACE_Port)) {
     if ((val = spa_dict_lookup(props, PW_KEY_PORT_MONITOR)) &&
         spa_streq(val, "true"))
@@ -493,91 +1073,30 @@ static void _global(void *_data, uint32_t id, uint32_t, const char *type,
 
     struct node *node = nullptr;
     if (context->filter && node_id == pw_filter_get_node_id(context->filter)) {
-      if (!(val = spa_dict_lookup(props, PW_KEY_PORT_EXTRA)))
+      // filter ports are named after their ASIO channel
+      if (!(val = spa_dict_lookup(props, PW_KEY_PORT_NAME)) ||
+          !(val = strrchr(val, '_')))
         return;
-      val += strlen(PWASIO_TARGET);
+      idx = pw_properties_parse_uint64(val + 1);
 
-      struct port *port = nullptr;
-      for (node = context->nodes; node && !port; node = node->next)
-        for (port = node->ports[!dir]; port; port = port->next) {
-          char name[MAX_STR];
-          snprintf(name, sizeof name, "%s:%s", node->name, port->name);
-          if (spa_streq(val, name))
-            break;
-        }
-      if (port) {
-        struct pw_properties *props;
-        if (!(props = pw_properties_new(PW_KEY_OBJECT_LINGER, "true", nullptr)))
-          return;
-        if (dir == PW_DIRECTION_INPUT) {
-          pw_properties_setf(props, PW_KEY_LINK_OUTPUT_PORT, "%u", port->id);
-          pw_properties_setf(props, PW_KEY_LINK_INPUT_PORT, "%u", id);
-        } else {
-          pw_properties_setf(props, PW_KEY_LINK_OUTPUT_PORT, "%u", id);
-          pw_properties_setf(props, PW_KEY_LINK_INPUT_PORT, "%u", port->id);
-        }
-        pw_proxy_destroy(pw_core_create_object(
-            context->core, "link-factory", PW_TYPE_INTERFACE_Link,
-            PW_VERSION_LINK, &props->dict, 0));
-        pw_properties_free(props);
+      if (!(val = spa_dict_lookup(props, PW_KEY_PORT_EXTRA)))
         return;
-      }
+      val += strlen(PWASIO_TARGET);
       dir = !dir;
-      node = context->unknown;
+      node = engine->graph.unknown;
     } else {
       if (!(val = spa_dict_lookup(props, PW_KEY_PORT_NAME)))
         return;
-      for (node = context->nodes; node; node = node->next)
-        if (node->id == node_id)
-          break;
-      if (!node)
+      if (!(node = engine_find_node(&engine->graph, node_id)))
         return;
     }
 
-    struct port *port, **root = &node->ports[dir];
-    if (!(port = malloc(sizeof *port)))
-      return;
-    *port = (typeof(*port)){
-        .idx = idx,
-        .id = id,
-    };
-    strncpy(port->name, val, sizeof port->name);
-
-    struct port **p = root;
-    while (*p && (*p)->idx < port->idx)
-      p = &(*p)->next;
-    port->next = *p;
-    *p = port;
+    if (engine_add_port(engine, node, dir, id, idx, val) < 0)
+      WINE_WARN("unable to keep track of port %u\n", id);
   }
 }
 void _global_remove(void *_data, uint32_t id) {
-  struct context *context = _data;
-  for (struct node *node = context->nodes, *prev = nullptr; node;
-       prev = node, node = node->next)
-    if (node->id == id) {
-      for (size_t i = 0; i < 2; i++)
-        for (struct port *port = node->ports[i], *p = nullptr; port; port = p) {
-          p = port->next;
-          free(port);
-        }
-      if (prev)
-        prev->next = node->next;
-      else
-        context->nodes = node->next;
-      free(node);
-      return;
-    } else
-      for (size_t i = 0; i < 2; i++)
-        for (struct port *port = node->ports[i], *prev = nullptr; port;
-             prev = port, port = port->next)
-          if (port->id == id) {
-            if (prev)
-              prev->next = port->next;
-            else
-              node->ports[i] = port->next;
-            free(port);
-            return;
-          }
+  engine_remove_global(&((struct pwasio *)_data)->engine, id);
 }
 static const struct pw_registry_events registry_events = {
     PW_VERSION_REGISTRY_EVENTS,
@@ -585,6 +1104,180 @@ static const struct pw_registry_events registry_events = {
     .global_remove = _global_remove,
 };
 
+// host blocks go through the rings whenever the graph may run a different
+// quantum or rate, which the internal backends never do
+static bool _reblocking(const struct pwasio *pwasio) {
+  return pwasio->backend == BACKEND_PIPEWIRE &&
+         (pwasio->reblock || (pwasio->resample != RESAMPLE_OFF &&
+                              pwasio->sample_rate != pwasio->graph_rate));
+}
+// the filter keeps the quantum, rate and scheduling it was created with, so
+// a change to any of them needs a new one, except for the buffer size when
+// reblocking, which is only a preference that can be updated in place
+static bool _filter_stale(const struct pwasio *pwasio,
+                          const struct filter_config *config) {
+  const struct filter_config *old = &pwasio->filter_config;
+  return (old->buffer_size != config->buffer_size && !config->reblock) ||
+         old->sample_rate != config->sample_rate ||
+         old->graph_rate != config->graph_rate ||
+         old->async != config->async || old->reblock != config->reblock;
+}
+static bool _can_resample(const struct pwasio *pwasio, double rate) {
+  if (pwasio->backend != BACKEND_PIPEWIRE)
+    return rate >= 1 && rate == round(rate);
+  struct resampler r = {};
+  bool res = pwasio->resample != RESAMPLE_OFF && rate >= 1 &&
+             rate == round(rate) &&
+             !resampler_init(&r, pwasio->graph_rate, rate, pwasio->resample);
+  resampler_clear(&r);
+  return res;
+}
+// tells the graph how much later than its own cycle host outputs follow the
+// inputs they were made from, which a synchronous host running at the graph
+// quantum doesn't add to
+static void _publish_latency(struct pwasio *pwasio) {
+  const struct reblock *rb = &pwasio->engine.reblock;
+  size_t frames = pwasio->plugin_delay + (rb->on ? rb->round_trip : 0);
+  struct spa_process_latency_info info = {
+      .quantum = pwasio->async ? 1.0f : 0.0f,
+      .ns = frames * SPA_NSEC_PER_SEC / pwasio->sample_rate,
+  };
+  WINE_TRACE("process latency %.0f quanta and %lu frames\n", info.quantum,
+             frames);
+
+  uint8_t buf[MAX_STR];
+  struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buf, sizeof buf);
+  const struct spa_pod *param =
+      spa_process_latency_build(&b, SPA_PARAM_ProcessLatency, &info);
+  if (pw_filter_update_params(pwasio->context.filter, nullptr, &param, 1) < 0)
+    WINE_WARN("unable to publish process latency\n");
+}
+
+// moves the node under the freewheel driver and back, which only sticks while
+// the filter exists, later ones pick the group up on creation
+static void _set_freewheel(struct pwasio *pwasio, bool on) {
+  struct context *context = &pwasio->context;
+  if (atomic_exchange(&pwasio->freewheel, on) == on)
+    return;
+  WINE_TRACE("%s freewheeling\n", on ? "start" : "stop");
+  pw_thread_loop_lock(context->th_loop);
+  if (context->filter &&
+      pw_filter_update_properties(
+          context->filter, nullptr,
+          &SPA_DICT_ITEMS(SPA_DICT_ITEM(
+              PW_KEY_NODE_GROUP, on ? FREEWHEEL_GROUP : DEFAULT_GROUP))) < 0)
+    WINE_WARN("unable to move node group\n");
+  pw_thread_loop_unlock(context->th_loop);
+}
+
+// adds the source driving an internal backend to the stopped data loop, which
+// only starts cycling once the host starts
+static int _setup_internal(struct pwasio *pwasio) {
+  struct internal *in = &pwasio->internal;
+  in->backend = pwasio->backend;
+  in->loop = pw_data_loop_get_loop(pwasio->context.loop);
+  in->position.clock = (struct spa_io_clock){
+      .id = SPA_ID_INVALID,
+      .rate = SPA_FRACTION(1, pwasio->sample_rate),
+      .duration = atomic_load(&pwasio->buffer_size),
+      .rate_diff = 1.0,
+  };
+
+  int res;
+  struct wav *wav = in->wav;
+  if (*pwasio->wav[PW_DIRECTION_INPUT]) {
+    if ((res = wav_open_read(&wav[PW_DIRECTION_INPUT],
+                             pwasio->wav[PW_DIRECTION_INPUT])) < 0)
+      return res;
+    if (wav[PW_DIRECTION_INPUT].rate != pwasio->sample_rate)
+      WINE_WARN("%s plays at %u Hz instead of %lu\n",
+                pwasio->wav[PW_DIRECTION_INPUT], wav[PW_DIRECTION_INPUT].rate,
+                pwasio->sample_rate);
+  }
+  if (*pwasio->wav[PW_DIRECTION_OUTPUT] &&
+      pwasio->table[PW_DIRECTION_OUTPUT].len &&
+      (res = wav_open_write(&wav[PW_DIRECTION_OUTPUT],
+                            pwasio->wav[PW_DIRECTION_OUTPUT],
+                            pwasio->table[PW_DIRECTION_OUTPUT].len,
+                            pwasio->sample_rate)) < 0)
+    return res;
+  size_t width = SPA_MAX(wav[0].channels, wav[1].channels);
+  if (width &&
+      !(in->frames = calloc(atomic_load(&pwasio->buffer_size) * width,
+                            sizeof(float))))
+    return -ENOMEM;
+
+  if (!(in->source = in->backend == BACKEND_FREERUN
+                         ? pw_loop_add_idle(in->loop, false, _on_idle, pwasio)
+                         : pw_loop_add_timer(in->loop, _on_timer, pwasio)))
+    return -errno;
+  WINE_TRACE("running on the %s backend\n", backend_names[in->backend]);
+  return 0;
+}
+// the data loop has to be stopped
+static void _clear_internal(struct pwasio *pwasio) {
+  struct internal *in = &pwasio->internal;
+  if (in->source)
+    pw_loop_destroy_source(in->loop, in->source);
+  in->source = nullptr;
+  for (size_t i = 0; i < 2; i++)
+    wav_close(&in->wav[i]);
+  free(in->frames);
+  in->frames = nullptr;
+}
+static int _run_internal(struct pwasio *pwasio, bool on) {
+  if (pwasio->backend == BACKEND_PIPEWIRE)
+    return 0;
+  return pw_data_loop_invoke(pwasio->context.loop, _arm, 0, &on, sizeof on,
+                             false, pwasio);
+}
+
+// tears down what DisposeBuffers leaves behind for reuse
+static void _destroy_buffers(struct pwasio *pwasio) {
+  struct context *context = &pwasio->context;
+  struct engine *engine = &pwasio->engine;
+
+  if (context->filter) {
+    pw_thread_loop_lock(context->th_loop);
+    pw_data_loop_stop(context->loop);
+    pw_filter_destroy(context->filter);
+    pw_thread_loop_unlock(context->th_loop);
+    context->filter = nullptr;
+  }
+  if (pwasio->internal.source) {
+    pw_thread_loop_lock(context->th_loop);
+    pw_data_loop_stop(context->loop);
+    pw_thread_loop_unlock(context->th_loop);
+  }
+  _clear_internal(pwasio);
+  // the panel reads counters off the channels
+  if (context->th_loop)
+    pw_thread_loop_lock(context->th_loop);
+  free(engine->channels);
+  engine->channels = nullptr;
+  engine->n_channels = 0;
+  for (size_t i = 0; i < 2; i++)
+    engine_activate(&pwasio->table[i], false);
+  if (context->th_loop)
+    pw_thread_loop_unlock(context->th_loop);
+  engine_clear_reblock(&engine->reblock);
+  free(engine->watchdog.last);
+  engine->watchdog.last = nullptr;
+  // a dump may still be pending on the thread loop
+  if (context->th_loop)
+    pw_thread_loop_lock(context->th_loop);
+  engine_clear_flight(&engine->flight);
+  if (context->th_loop)
+    pw_thread_loop_unlock(context->th_loop);
+  if (engine->buffer != MAP_FAILED)
+    munmap(engine->buffer, engine_arena_size(engine, engine->n_slots));
+  engine->buffer = MAP_FAILED;
+  engine->n_slots = 0;
+  if (engine->fd >= 0)
+    close(engine->fd);
+  engine->fd = -1;
+}
+
 STDMETHODIMP QueryInterface(struct asio *_data, REFIID riid, PVOID *out) {
   WINE_TRACE("\n");
   struct pwasio *pwasio = (struct pwasio *)_data;
@@ -620,12 +1313,18 @@ STDMETHODIMP_(ULONG32) Release(struct asio *_data) {
   }
 
   struct context *context = &pwasio->context;
-  if (context->filter)
+  if (pwasio->callbacks)
     pwasio->vtbl->DisposeBuffers(_data);
+  _destroy_buffers(pwasio);
 
-  for (size_t i = 0; i < 2; i++)
+  for (size_t i = 0; i < 2; i++) {
     if (pwasio->ports[i] != dummy_port)
       free(pwasio->ports[i]);
+    free(pwasio->table[i].entries);
+  }
+  for (size_t i = 0; i < pwasio->n_retired; i++)
+    free(pwasio->retired[i]);
+  free(pwasio->retired);
 
   if (context->th_loop) {
     pw_loop_invoke(pw_thread_loop_get_loop(context->th_loop), nullptr, 0,
@@ -636,15 +1335,7 @@ STDMETHODIMP_(ULONG32) Release(struct asio *_data) {
     spa_hook_remove(&context->registry_listener);
     pw_proxy_destroy((struct pw_proxy *)context->registry);
   }
-  for (struct node *node = context->nodes, *next; node; node = next) {
-    for (size_t i = 0; i < 2; i++)
-      for (struct port *port = node->ports[i], *next; port; port = next) {
-        next = port->next;
-        free(port);
-      }
-    next = node->next;
-    free(node);
-  }
+  engine_clear_graph(&pwasio->engine.graph);
 
   if (context->core) {
     spa_hook_remove(&context->core_listener);
@@ -655,11 +1346,18 @@ STDMETHODIMP_(ULONG32) Release(struct asio *_data) {
   if (context->th_loop)
     pw_thread_loop_destroy(context->th_loop);
 
-  if (pwasio->host_priority) {
-    WINE_TRACE("setting host scheduler to SCHED_OTHER\n");
-    pthread_setschedparam(pwasio->host_tid, SCHED_OTHER,
-                          &(struct sched_param){.sched_priority = 0});
+  // threads that are gone by now are left alone, as are ones whose id has
+  // since been reused by another thread
+  size_t n_promoted = SPA_MIN(pwasio->n_promoted, MAX_PROMOTED);
+  for (size_t i = 0; i < n_promoted; i++) {
+    const struct promoted *p = &pwasio->promoted[i];
+    if (!p->start || _start_time(p->pid) != p->start)
+      continue;
+    WINE_TRACE("setting host thread %d scheduler to SCHED_OTHER\n", p->pid);
+    sched_setscheduler(p->pid, SCHED_OTHER,
+                       &(struct sched_param){.sched_priority = 0});
   }
+  rtkit_close(&pwasio->rtkit);
 
   WINE_TRACE("stopping PipeWire\n");
   pw_deinit();
@@ -683,6 +1381,7 @@ STDMETHODIMP_(LONG32) Init(struct asio *_data, void *) {
 
   int res;
   char msg[256];
+  HKEY key = nullptr;
 
   struct pw_properties *props;
   if (!(props = pw_properties_new(PW_KEY_CLIENT_NAME, pwasio->name,
@@ -713,72 +1412,105 @@ STDMETHODIMP_(LONG32) Init(struct asio *_data, void *) {
   pw_thread_loop_start(context->th_loop);
   pw_thread_loop_lock(context->th_loop);
 
-  if (!(context->core = pw_context_connect(context->context, props, 0))) {
-    res = ASIO_ERROR_NO_MEMORY;
-    snprintf(msg, sizeof msg, "failed to connect to PipeWire");
-    goto cleanup;
-  }
+  if (RegCreateKeyEx(HKEY_CURRENT_USER, DRIVER_REG, 0, nullptr, 0,
+                     KEY_WRITE | KEY_READ, nullptr, &key,
+                     nullptr) != ERROR_SUCCESS)
+    key = nullptr;
 
-  props = nullptr;
-  pw_core_add_listener(context->core, &context->core_listener, &core_events,
-                       context);
+  DWORD out;
+  if (key && RegQueryValueEx(key, KEY_BACKEND, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS &&
+      out < N_BACKENDS)
+    pwasio->backend = out;
+  else
+    pwasio->backend = DEFAULT_BACKEND;
 
-  if (!(context->nodes = context->unknown = malloc(sizeof *context->unknown))) {
+  // filter ports are listed under this one, with or without a daemon
+  if (engine_init_graph(&pwasio->engine.graph) < 0) {
     res = ASIO_ERROR_NO_MEMORY;
     snprintf(msg, sizeof msg, "failed to allocate node tree");
     goto cleanup;
   }
-  *context->nodes = (typeof(*context->nodes)){
-      .id = SPA_ID_INVALID,
-      .display = "Unknown",
-  };
 
-  if (!(context->registry =
-            pw_core_get_registry(context->core, PW_VERSION_REGISTRY, 0))) {
-    res = ASIO_ERROR_NO_MEMORY;
-    snprintf(msg, sizeof msg, "failed to enumerate PipeWire objects");
-    goto cleanup;
-  }
-  pw_registry_add_listener(context->registry, &context->registry_listener,
-                           &registry_events, context);
-  context->pending =
-      pw_proxy_sync((struct pw_proxy *)context->core, context->pending);
-  while (true) {
-    pw_thread_loop_wait(context->th_loop);
-    if (context->res < 0) {
-      res = ASIO_ERROR_HW_MALFUNCTION;
-      snprintf(msg, sizeof msg, "PipeWire core error");
+  if (pwasio->backend == BACKEND_PIPEWIRE) {
+    if (!(context->core = pw_context_connect(context->context, props, 0))) {
+      res = ASIO_ERROR_NO_MEMORY;
+      snprintf(msg, sizeof msg, "failed to connect to PipeWire");
       goto cleanup;
     }
-    if (context->last == context->pending)
-      break;
-  }
 
-  HKEY key = nullptr;
-  if (RegCreateKeyEx(HKEY_CURRENT_USER, DRIVER_REG, 0, nullptr, 0,
-                     KEY_WRITE | KEY_READ, nullptr, &key,
-                     nullptr) != ERROR_SUCCESS)
-    key = nullptr;
+    props = nullptr;
+    pw_core_add_listener(context->core, &context->core_listener, &core_events,
+                         context);
 
-  DWORD out;
+    if (!(context->registry =
+              pw_core_get_registry(context->core, PW_VERSION_REGISTRY, 0))) {
+      res = ASIO_ERROR_NO_MEMORY;
+      snprintf(msg, sizeof msg, "failed to enumerate PipeWire objects");
+      goto cleanup;
+    }
+    pw_registry_add_listener(context->registry, &context->registry_listener,
+                             &registry_events, pwasio);
+    context->pending =
+        pw_proxy_sync((struct pw_proxy *)context->core, context->pending);
+    while (true) {
+      pw_thread_loop_wait(context->th_loop);
+      if (context->res < 0) {
+        res = ASIO_ERROR_HW_MALFUNCTION;
+        snprintf(msg, sizeof msg, "PipeWire core error");
+        goto cleanup;
+      }
+      if (context->last == context->pending)
+        break;
+    }
+  } else {
+    pw_properties_free(props);
+    props = nullptr;
+  }
+
+  size_t buffer_size;
   if (key && RegQueryValueEx(key, KEY_BUFSIZE, 0, nullptr, (BYTE *)&out,
                              &(DWORD){sizeof out}) == ERROR_SUCCESS)
-    pwasio->buffer_size = out;
+    buffer_size = out;
   else if (context->settings) {
     struct metadata *settings =
         pw_proxy_get_user_data((struct pw_proxy *)context->settings);
-    pwasio->buffer_size = settings->buffer_size;
+    buffer_size = settings->buffer_size;
   } else
-    pwasio->buffer_size = DEFAULT_BUFSIZE;
-  if (key && RegQueryValueEx(key, KEY_SMPRATE, 0, nullptr, (BYTE *)&out,
+    buffer_size = DEFAULT_BUFSIZE;
+  pwasio->adapt = (struct adapt){
+      .base = buffer_size,
+      .max = MAX_QUANTUM,
+  };
+  if (context->settings) {
+    struct metadata *settings =
+        pw_proxy_get_user_data((struct pw_proxy *)context->settings);
+    pwasio->adapt.max = SPA_MIN(settings->max_quantum, MAX_QUANTUM);
+  }
+  if (key && RegQueryValueEx(key, KEY_ADAPTIVE, 0, nullptr, (BYTE *)&out,
                              &(DWORD){sizeof out}) == ERROR_SUCCESS)
-    pwasio->sample_rate = out;
-  else if (context->settings) {
+    pwasio->adapt.threshold = out;
+  else
+    pwasio->adapt.threshold = DEFAULT_ADAPTIVE;
+  // hosts reset for a new size come back here, and carry on from it
+  size_t size = atomic_load(&adapted);
+  if (pwasio->adapt.threshold && size > buffer_size &&
+      size <= pwasio->adapt.max) {
+    WINE_TRACE("buffer size %lu adapted from %lu\n", size, buffer_size);
+    buffer_size = size;
+  }
+  atomic_store(&pwasio->buffer_size, buffer_size);
+  if (context->settings) {
     struct metadata *settings =
         pw_proxy_get_user_data((struct pw_proxy *)context->settings);
-    pwasio->sample_rate = settings->sample_rate;
+    pwasio->graph_rate = settings->sample_rate;
   } else
-    pwasio->sample_rate = DEFAULT_SMPRATE;
+    pwasio->graph_rate = DEFAULT_SMPRATE;
+  if (key && RegQueryValueEx(key, KEY_SMPRATE, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->sample_rate = out;
+  else
+    pwasio->sample_rate = pwasio->graph_rate;
   if (context->settings) {
     struct metadata *settings =
         pw_proxy_get_user_data((struct pw_proxy *)context->settings);
@@ -808,6 +1540,110 @@ STDMETHODIMP_(LONG32) Init(struct asio *_data, void *) {
   else
     pwasio->host_priority = pwasio->thread.priority / 2;
 
+  if (key && RegQueryValueEx(key, KEY_STACK, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS) {
+    if (out > MAX_STACK)
+      WINE_WARN("stack prefault of %u KiB capped to %u\n", (unsigned)out,
+                MAX_STACK);
+    pwasio->thread.stack = SPA_MIN(out, MAX_STACK) * 1024;
+  } else
+    pwasio->thread.stack = DEFAULT_STACK * 1024;
+
+  if (key && RegQueryValueEx(key, KEY_DEADLINE, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->thread.budget = SPA_MIN(out, 100);
+  else
+    pwasio->thread.budget = DEFAULT_DEADLINE;
+  pwasio->thread.refused = false;
+  pwasio->thread.duration = buffer_size;
+  pwasio->thread.rate = pwasio->sample_rate;
+
+  if (key && RegQueryValueEx(key, KEY_ASYNC, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->async = out;
+  else
+    pwasio->async = DEFAULT_ASYNC;
+  if (key && RegQueryValueEx(key, KEY_REBLOCK, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->reblock = out;
+  else
+    pwasio->reblock = DEFAULT_REBLOCK;
+  if (key && RegQueryValueEx(key, KEY_RESAMPLE, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS &&
+      out < N_RESAMPLE_QUALITIES)
+    pwasio->resample = out;
+  else
+    pwasio->resample = DEFAULT_RESAMPLE;
+  if (key && RegQueryValueEx(key, KEY_WATCHDOG, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS &&
+      out < N_WATCHDOGS)
+    pwasio->watchdog = out;
+  else
+    pwasio->watchdog = DEFAULT_WATCHDOG;
+  if (key && RegQueryValueEx(key, KEY_SANITIZE, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->sanitize = out;
+  else
+    pwasio->sanitize = DEFAULT_SANITIZE;
+  if (key && RegQueryValueEx(key, KEY_PLUGIN_DELAY, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->plugin_delay = out;
+  else
+    pwasio->plugin_delay = DEFAULT_PLUGIN_DELAY;
+  if (key && RegQueryValueEx(key, KEY_LATENCY_CORRECTION, 0, nullptr,
+                             (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->latency_correction = (LONG)out;
+  else
+    pwasio->latency_correction = DEFAULT_LATENCY_CORRECTION;
+  for (size_t i = 0; i < 2; i++)
+    if (!key || RegQueryValueEx(key, i ? KEY_WAV_OUTPUT : KEY_WAV_INPUT,
+                                nullptr, nullptr, (BYTE *)pwasio->wav[i],
+                                &(DWORD){sizeof pwasio->wav[i]}))
+      *pwasio->wav[i] = '\0';
+  if (key && RegQueryValueEx(key, KEY_FLIGHT, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->flight = SPA_MIN(out, 60);
+  else
+    pwasio->flight = DEFAULT_FLIGHT;
+  if (!key || RegQueryValueEx(key, KEY_FLIGHT_DIR, nullptr, nullptr,
+                              (BYTE *)pwasio->flight_dir,
+                              &(DWORD){sizeof pwasio->flight_dir}) ||
+      !*pwasio->flight_dir)
+    strcpy(pwasio->flight_dir, DEFAULT_FLIGHT_DIR);
+
+  if (key && RegQueryValueEx(key, KEY_DMA_LATENCY, 0, nullptr, (BYTE *)&out,
+                             &(DWORD){sizeof out}) == ERROR_SUCCESS)
+    pwasio->qos.latency = (int)out;
+  else
+    pwasio->qos.latency = DEFAULT_DMA_LATENCY;
+  if (!key || RegQueryValueEx(key, KEY_GOVERNOR, nullptr, nullptr,
+                              (BYTE *)pwasio->qos.governor,
+                              &(DWORD){sizeof pwasio->qos.governor}))
+    *pwasio->qos.governor = '\0';
+
+  for (size_t i = 0; i < 2; i++) {
+    cpu_set_t *cpus = i ? &pwasio->host_cpus : &pwasio->thread.cpus;
+    DWORD len = sizeof pwasio->cpus[i];
+    if (key && RegQueryValueEx(key, i ? KEY_HOST_CPUS : KEY_CPUS, nullptr,
+                               nullptr, (BYTE *)pwasio->cpus[i],
+                               &len) == ERROR_SUCCESS &&
+        !_parse_cpus(pwasio->cpus[i], cpus)) {
+      WINE_WARN("invalid cpu list %s\n", pwasio->cpus[i]);
+      *pwasio->cpus[i] = '\0';
+      CPU_ZERO(cpus);
+    }
+    if (_check_irqs(cpus, msg, sizeof msg))
+      WINE_WARN("%s %s\n", i ? "host" : "driver", msg);
+  }
+  // the kernel refuses SCHED_DEADLINE to tasks with narrower affinity than
+  // their root domain, the list is kept for the panel to show
+  if (pwasio->thread.budget && CPU_COUNT(&pwasio->thread.cpus)) {
+    WINE_WARN("driver cpu list %s ignored under SCHED_DEADLINE\n",
+              pwasio->cpus[0]);
+    CPU_ZERO(&pwasio->thread.cpus);
+  }
+
   if (key && RegQueryValueEx(key, KEY_INPUTS, nullptr, nullptr, nullptr,
                              &out) == ERROR_SUCCESS) {
     if ((pwasio->ports[PW_DIRECTION_INPUT] = malloc(out)))
@@ -826,7 +1662,7 @@ STDMETHODIMP_(LONG32) Init(struct asio *_data, void *) {
       if (context->defaults) {
         struct metadata *defaults =
             pw_proxy_get_user_data((struct pw_proxy *)context->defaults);
-        for (const struct node *node = context->nodes;
+        for (const struct node *node = pwasio->engine.graph.nodes;
              node && !pwasio->ports[i]; node = node->next)
           if (spa_streq(node->name, defaults->defaults[i])) {
             size_t len = 1;
@@ -857,6 +1693,7 @@ STDMETHODIMP_(LONG32) Init(struct asio *_data, void *) {
 
   if (key)
     RegCloseKey(key);
+  key = nullptr;
 
   if (!*pwasio->ports[PW_DIRECTION_INPUT] &&
       !*pwasio->ports[PW_DIRECTION_OUTPUT]) {
@@ -865,51 +1702,52 @@ STDMETHODIMP_(LONG32) Init(struct asio *_data, void *) {
     goto cleanup;
   }
 
+  for (size_t i = 0; i < 2; i++)
+    if (engine_build_table(&pwasio->engine.graph, pwasio->ports[i],
+                           &pwasio->table[i]) < 0) {
+      res = ASIO_ERROR_NO_MEMORY;
+      snprintf(msg, sizeof msg, "channel table allocation failed");
+      goto cleanup;
+    }
+
   if (pwasio->thread.priority) {
     struct rlimit rl;
     if (getrlimit(RLIMIT_RTPRIO, &rl) || rl.rlim_max < 1 ||
         !(rl.rlim_cur =
               SPA_MAX(pwasio->thread.priority, pwasio->host_priority)) ||
         setrlimit(RLIMIT_RTPRIO, &rl)) {
-      res = ASIO_ERROR_HW_MALFUNCTION;
-      snprintf(msg, sizeof msg, "unable to get realtime privileges: %s",
-               strerror(errno));
-      goto cleanup;
-    }
-    if (pwasio->host_priority) {
-      pwasio->host_tid = pthread_self();
-      WINE_TRACE("setting host scheduler to SCHED_FIFO with priority %d\n",
-                 pwasio->host_priority);
-      if (pthread_setschedparam(
-              pwasio->host_tid, SCHED_FIFO,
-              &(struct sched_param){.sched_priority = pwasio->host_priority}))
-        WINE_ERR("unable to set host realtime priority\n");
+      WINE_WARN("unable to raise RLIMIT_RTPRIO: %s, trying RTKit\n",
+                strerror(errno));
+      if (!rtkit_open(&pwasio->rtkit)) {
+        res = ASIO_ERROR_HW_MALFUNCTION;
+        snprintf(msg, sizeof msg, "unable to get realtime privileges");
+        goto cleanup;
+      }
+      pwasio->thread.rtkit = &pwasio->rtkit;
     }
   }
+  _promote(pwasio, ROLE_HOST,
+           pwasio->thread.priority ? pwasio->host_priority : 0);
 
   pw_thread_loop_unlock(context->th_loop);
 
   return 1;
 
 cleanup:
-  for (size_t i = 0; i < 2; i++)
+  if (key)
+    RegCloseKey(key);
+  for (size_t i = 0; i < 2; i++) {
     if (pwasio->ports[i] != dummy_port)
       free(pwasio->ports[i]);
+    free(pwasio->table[i].entries);
+    pwasio->table[i] = (struct table){};
+  }
   if (context->registry) {
     spa_hook_remove(&context->registry_listener);
     pw_proxy_destroy((struct pw_proxy *)context->registry);
     context->registry = nullptr;
   }
-  for (struct node *node = context->nodes, *next; node; node = next) {
-    for (size_t i = 0; i < 2; i++)
-      for (struct port *port = node->ports[i], *next; port; port = next) {
-        next = port->next;
-        free(port);
-      }
-    next = node->next;
-    free(node);
-  }
-  context->nodes = nullptr;
+  engine_clear_graph(&pwasio->engine.graph);
   if (context->core) {
     spa_hook_remove(&context->core_listener);
     pw_core_disconnect(context->core);
@@ -925,6 +1763,8 @@ cleanup:
   }
   if (props)
     pw_properties_free(props);
+  rtkit_close(&pwasio->rtkit);
+  pwasio->thread.rtkit = nullptr;
 
   pwasio_err(res, "%s", msg);
 }
@@ -950,27 +1790,118 @@ STDMETHODIMP_(VOID) GetErrorMessage(struct asio *_data, PSTR string) {
     snprintf(string, ASIO_MAX_ERR, "undocumented error\n");
 }
 
+static bool _adapt(struct pwasio *pwasio) {
+  struct adapt *adapt = &pwasio->adapt;
+  struct load *load = &pwasio->engine.load;
+  uint64_t overruns =
+      atomic_load_explicit(&load->overruns, memory_order_relaxed);
+  unsigned peak =
+      atomic_exchange_explicit(&load->peak, 0, memory_order_relaxed);
+  uint64_t late = overruns - adapt->overruns;
+  adapt->overruns = overruns;
+
+  if (!late && peak < ADAPT_HEADROOM)
+    adapt->calm++;
+  else
+    adapt->calm = 0;
+  size_t prev = atomic_load(&pwasio->buffer_size), size = prev;
+  if (late >= adapt->threshold && 2 * size <= adapt->max)
+    size *= 2;
+  else if (adapt->calm >= ADAPT_CALM && size > adapt->base)
+    size = SPA_MAX(size / 2, adapt->base);
+  if (size == prev)
+    return false;
+
+  WINE_WARN("buffer size %lu -> %lu, %lu late host calls, peak load %u%%\n",
+            prev, size, late, peak / 10);
+  adapt->calm = 0;
+  atomic_store(&pwasio->buffer_size, size);
+  atomic_store(&adapted, size);
+  if ((adapt->reset ? pwasio->callbacks->message(ASIO_MESSAGE_RESET_REQUEST,
+                                                 0, nullptr, nullptr)
+                    : pwasio->callbacks->message(
+                          ASIO_MESSAGE_BUFFER_SIZE_CHANGE, size, nullptr,
+                          nullptr)) != 1) {
+    WINE_WARN("host refused buffer size %lu\n", size);
+    atomic_store(&pwasio->buffer_size, prev);
+    atomic_store(&adapted, prev);
+    return false;
+  }
+  return true;
+}
+// the policy runs in a Wine thread of its own so that the host can be told
+// from it, and ends once the host has taken a new size, restarting it along
+// with the buffers
+static DWORD WINAPI _adapt_thread(LPVOID p) {
+  struct pwasio *pwasio = p;
+  while (WaitForSingleObject(pwasio->adapt.stop, ADAPT_WINDOW_MS) ==
+         WAIT_TIMEOUT)
+    if (_adapt(pwasio))
+      break;
+  return 0;
+}
+static void _start_adapt(struct pwasio *pwasio) {
+  struct adapt *adapt = &pwasio->adapt;
+  struct load *load = &pwasio->engine.load;
+  if (!load->on)
+    return;
+  adapt->overruns = atomic_load_explicit(&load->overruns, memory_order_relaxed);
+  adapt->calm = 0;
+  atomic_store_explicit(&load->peak, 0, memory_order_relaxed);
+  if (!(adapt->stop = CreateEvent(nullptr, true, false, nullptr)) ||
+      !(adapt->thread = CreateThread(nullptr, 0, _adapt_thread, pwasio, 0,
+                                     &adapt->thread_id))) {
+    WINE_WARN("unable to start buffer size adaptation\n");
+    if (adapt->stop)
+      CloseHandle(adapt->stop);
+    adapt->stop = nullptr;
+  }
+}
+static void _stop_adapt(struct pwasio *pwasio) {
+  struct adapt *adapt = &pwasio->adapt;
+  if (!adapt->thread)
+    return;
+  SetEvent(adapt->stop);
+  // hosts may well stop from within the message the thread sent
+  if (GetCurrentThreadId() != adapt->thread_id)
+    WaitForSingleObject(adapt->thread, INFINITE);
+  CloseHandle(adapt->thread);
+  CloseHandle(adapt->stop);
+  adapt->thread = adapt->stop = nullptr;
+}
+
 STDMETHODIMP_(LONG32) Start(struct asio *_data) {
   WINE_TRACE("\n");
   struct pwasio *pwasio = (struct pwasio *)_data;
-  const struct context *context = &pwasio->context;
-  const struct engine *engine = &pwasio->engine;
+  struct engine *engine = &pwasio->engine;
 
   if (!*pwasio->ports[PW_DIRECTION_INPUT] &&
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  if (engine->running)
-    return ASIO_ERROR_OK;
+  if (!pwasio->callbacks)
+    pwasio_err(ASIO_ERROR_INVALID_MODE, "no buffers");
 
-  pw_thread_loop_lock(context->th_loop);
-  int res = pw_data_loop_start(context->loop);
-  pw_thread_loop_unlock(context->th_loop);
+  if (atomic_load_explicit(&engine->running, memory_order_relaxed))
+    return ASIO_ERROR_OK;
 
-  if (res < 0)
-    pwasio_err(ASIO_ERROR_HW_MALFUNCTION, "failed to start PipeWire data loop");
+  // governors only stay local when both driver and host are pinned
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (CPU_COUNT(&pwasio->thread.cpus) && CPU_COUNT(&pwasio->host_cpus))
+    CPU_OR(&cpus, &pwasio->thread.cpus, &pwasio->host_cpus);
+  _qos_acquire(&pwasio->qos, &cpus);
+
+  // the half is picked by the data thread from the buffers it dequeues
+  atomic_store_explicit(&engine->running, true, memory_order_release);
+  if (_run_internal(pwasio, true) < 0) {
+    atomic_store_explicit(&engine->running, false, memory_order_release);
+    _qos_release(&pwasio->qos);
+    pwasio_err(ASIO_ERROR_HW_MALFUNCTION, "failed to start %s backend",
+               backend_names[pwasio->backend]);
+  }
+  _start_adapt(pwasio);
 
-  pwasio->engine.running = true;
   return ASIO_ERROR_OK;
 }
 
@@ -985,16 +1916,27 @@ STDMETHODIMP_(LONG32) Stop(struct asio *_data) {
 
   struct engine *engine = &pwasio->engine;
 
-  if (!engine->running)
+  if (!atomic_load_explicit(&engine->running, memory_order_relaxed))
     return ASIO_ERROR_OK;
 
-  engine->running = false;
-  pw_thread_loop_lock(context->th_loop);
-  int res = pw_data_loop_stop(context->loop);
-  pw_thread_loop_unlock(context->th_loop);
+  _stop_adapt(pwasio);
+  atomic_store_explicit(&engine->running, false, memory_order_release);
+  _run_internal(pwasio, false);
 
-  if (res < 0)
-    pwasio_err(ASIO_ERROR_HW_MALFUNCTION, "failed to stop PipeWire data loop");
+  _qos_release(&pwasio->qos);
+
+  // wait for a callback that might be in flight
+  if (pw_data_loop_invoke(context->loop, nullptr, 0, nullptr, 0, true,
+                          nullptr) < 0)
+    pwasio_err(ASIO_ERROR_HW_MALFUNCTION, "failed to sync PipeWire data loop");
+
+  uint64_t overruns = atomic_load_explicit(&engine->watchdog.overruns,
+                                           memory_order_relaxed);
+  if (overruns)
+    WINE_WARN("host overran %lu cycles, worst by %lu us\n", overruns,
+              atomic_load_explicit(&engine->watchdog.worst,
+                                   memory_order_relaxed) /
+                  SPA_NSEC_PER_USEC);
 
   return ASIO_ERROR_OK;
 }
@@ -1008,19 +1950,31 @@ GetChannels(struct asio *_data, LONG *n_inputs, LONG *n_outputs) {
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  *n_inputs = 0;
-  for (const char *p = (pwasio->ports[SPA_DIRECTION_INPUT]); *p;
-       p += strlen(p) + 1)
-    (*n_inputs)++;
-
-  *n_outputs = 0;
-  for (const char *p = (pwasio->ports[SPA_DIRECTION_OUTPUT]); *p;
-       p += strlen(p) + 1)
-    (*n_outputs)++;
+  *n_inputs = pwasio->table[PW_DIRECTION_INPUT].len;
+  *n_outputs = pwasio->table[PW_DIRECTION_OUTPUT].len;
 
   return ASIO_ERROR_OK;
 }
 
+// what the driver accounts for on its own, without the measured correction
+static void _latencies(const struct pwasio *pwasio, LONG *in, LONG *out) {
+  // async nodes read the previous cycle and write for the next one
+  size_t buffer_size = atomic_load(&pwasio->buffer_size);
+  *in = buffer_size * (pwasio->async ? 2 : 1);
+  *out = buffer_size * (pwasio->async ? 2 : 1);
+  const struct reblock *rb = &pwasio->engine.reblock;
+  if (rb->on) {
+    *in += atomic_load_explicit(&rb->latency[PW_DIRECTION_INPUT],
+                                memory_order_relaxed);
+    *out += atomic_load_explicit(&rb->latency[PW_DIRECTION_OUTPUT],
+                                 memory_order_relaxed);
+  } else if (_reblocking(pwasio)) {
+    // worst case until buffers exist
+    *in += buffer_size;
+    *out += buffer_size;
+  }
+}
+
 STDMETHODIMP_(LONG)
 GetLatencies(struct asio *_data, LONG *in, LONG *out) {
   WINE_TRACE("\n");
@@ -1030,8 +1984,11 @@ GetLatencies(struct asio *_data, LONG *in, LONG *out) {
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  *in = pwasio->buffer_size;
-  *out = pwasio->buffer_size;
+  // a measured round trip only tells the sum, which is split evenly
+  _latencies(pwasio, in, out);
+  LONG c = pwasio->latency_correction;
+  *in = SPA_MAX(*in + c / 2, 0);
+  *out = SPA_MAX(*out + c - c / 2, 0);
 
   return ASIO_ERROR_OK;
 }
@@ -1046,7 +2003,7 @@ GetBufferSize(struct asio *_data, LONG32 *min, LONG32 *max, LONG32 *pref,
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  *min = *max = *pref = pwasio->buffer_size;
+  *min = *max = *pref = atomic_load(&pwasio->buffer_size);
   *grn = 0;
   return ASIO_ERROR_OK;
 }
@@ -1059,7 +2016,7 @@ STDMETHODIMP_(LONG32) CanSampleRate(struct asio *_data, DOUBLE rate) {
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  if (fabs(rate - pwasio->sample_rate) > 0.5)
+  if (fabs(rate - pwasio->sample_rate) > 0.5 && !_can_resample(pwasio, rate))
     pwasio_err(ASIO_ERROR_NO_CLOCK, "invalid sample rate");
 
   return ASIO_ERROR_OK;
@@ -1084,9 +2041,15 @@ STDMETHODIMP_(LONG32) SetSampleRate(struct asio *_data, DOUBLE rate) {
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  if (fabs(rate - pwasio->sample_rate) > 0.5)
+  if (fabs(rate - pwasio->sample_rate) <= 0.5)
+    return ASIO_ERROR_OK;
+  if (!_can_resample(pwasio, rate))
     pwasio_err(ASIO_ERROR_NO_CLOCK, "invalid sample rate");
 
+  // not persisted, and only picked up when buffers are next created
+  pwasio->sample_rate = lround(rate);
+  WINE_TRACE("host rate set to %lu\n", pwasio->sample_rate);
+
   return ASIO_ERROR_OK;
 }
 
@@ -1139,25 +2102,22 @@ GetSamplePosition(struct asio *_data, struct asio_samples *pos,
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  if (!engine->running)
+  if (!atomic_load_explicit(&engine->running, memory_order_relaxed))
     pwasio_err(ASIO_ERROR_SP_NOT_ADVANCING, "clock not running");
 
-  pthread_t tid;
-  if ((tid = pthread_self()) != pwasio->audio_tid) {
-    pwasio->audio_tid = tid;
-    if (pthread_setschedparam(
-            pwasio->audio_tid, SCHED_FIFO,
-            &(struct sched_param){.sched_priority = pwasio->thread.priority}))
-      WINE_ERR("unable to set host realtime priority\n");
-  }
+  _promote(pwasio, ROLE_AUDIO, pwasio->thread.priority);
 
+  struct snapshot snap = engine_read_clock(&engine->clock);
+  // the graph counts its own frames
+  if (snap.rate && snap.rate != pwasio->sample_rate)
+    snap.pos = (double)snap.pos * pwasio->sample_rate / snap.rate;
   *pos = (typeof(*pos)){
-      .lo = engine->pos,
-      .hi = engine->pos >> 32,
+      .lo = snap.pos,
+      .hi = snap.pos >> 32,
   };
   *nsec = (typeof(*nsec)){
-      .lo = engine->nsec,
-      .hi = engine->nsec >> 32,
+      .lo = snap.time,
+      .hi = snap.time >> 32,
   };
 
   return ASIO_ERROR_OK;
@@ -1172,27 +2132,18 @@ GetChannelInfo(struct asio *_data, struct asio_channel_info *info) {
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  struct engine *engine = &pwasio->engine;
+  enum pw_direction dir =
+      info->input ? PW_DIRECTION_INPUT : PW_DIRECTION_OUTPUT;
+  const struct entry *entry;
+  if (!(entry = engine_entry(&pwasio->table[dir], info->index)))
+    pwasio_err(ASIO_ERROR_INVALID_PARAMETER, "invalid %s channel %d",
+               info->input ? "input" : "output", info->index);
 
-  if (info->input) {
-    if (engine->channels)
-      for (size_t i = 0; i < engine->n_channels; i++)
-        if (engine->channels[i].dir == PW_DIRECTION_INPUT &&
-            engine->channels[i].idx == (size_t)info->index) {
-          info->active = true;
-          break;
-        }
-    snprintf(info->name, sizeof info->name, "in_%d", info->index);
-  } else {
-    if (engine->channels)
-      for (size_t i = 0; i < engine->n_channels; i++)
-        if (engine->channels[i].dir == PW_DIRECTION_OUTPUT &&
-            engine->channels[i].idx == (size_t)info->index) {
-          info->active = true;
-          break;
-        }
-    snprintf(info->name, sizeof info->name, "out_%d", info->index);
-  }
+  // names can change under a live retarget
+  pw_thread_loop_lock(pwasio->context.th_loop);
+  info->active = entry->active;
+  strcpy(info->name, entry->name);
+  pw_thread_loop_unlock(pwasio->context.th_loop);
 
   info->group = 0;
   info->type = ASIO_SAMPLE_TYPE_FLOAT32_LSB;
@@ -1207,76 +2158,195 @@ CreateBuffers(struct asio *_data, struct asio_buffer_info *channels,
   WINE_TRACE("\n");
   struct pwasio *pwasio = (struct pwasio *)_data;
   struct context *context = &pwasio->context;
+  struct engine *engine = &pwasio->engine;
 
   if (!*pwasio->ports[PW_DIRECTION_INPUT] &&
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  if (buffer_size != (LONG32)pwasio->buffer_size)
-    pwasio_err(ASIO_ERROR_INVALID_MODE, "invalid buffer size %d", buffer_size);
+  if (pwasio->callbacks)
+    pwasio_err(ASIO_ERROR_INVALID_MODE, "buffers already created");
 
-  size_t pagesize = getpagesize();
-  struct engine *engine = &pwasio->engine;
-  *engine = (typeof(*engine)){
-      .n_channels = n_channels,
+  if (buffer_size != (LONG32)atomic_load(&pwasio->buffer_size))
+    pwasio_err(ASIO_ERROR_INVALID_MODE, "invalid buffer size %d", buffer_size);
 
-      .fd = -1,
-      .maxsize = ((buffer_size * sizeof(float) + pagesize - 1) / pagesize) *
-                 pagesize / sizeof(float),
-      .buffer = MAP_FAILED,
+  for (size_t c = 0; c < (size_t)n_channels; c++) {
+    enum pw_direction dir =
+        channels[c].input ? PW_DIRECTION_INPUT : PW_DIRECTION_OUTPUT;
+    if (!engine_entry(&pwasio->table[dir], channels[c].index))
+      pwasio_err(ASIO_ERROR_INVALID_PARAMETER, "invalid %s channel %d",
+                 channels[c].input ? "input" : "output", channels[c].index);
+  }
 
-      .callbacks = callbacks,
+  // PipeWire buffers are sized for any quantum when reblocking, with the
+  // host getting separate halves of its own size
+  bool reblock = _reblocking(pwasio);
+  size_t page = getpagesize() / sizeof(float);
+  size_t maxsize =
+      SPA_ROUND_UP(reblock ? MAX_QUANTUM : (size_t)buffer_size, page);
+  size_t blocksize = reblock ? SPA_ROUND_UP(buffer_size, page) : 0;
+  const struct filter_config config = {
+      .buffer_size = buffer_size,
+      .sample_rate = pwasio->sample_rate,
+      .graph_rate = pwasio->graph_rate,
+      .async = pwasio->async,
+      .reblock = reblock,
   };
-
-  size_t fsize = 2 * n_channels * engine->maxsize * sizeof(float);
+  if ((context->filter || engine->buffer != MAP_FAILED) &&
+      (engine->maxsize != maxsize || engine->blocksize != blocksize ||
+       engine->reblock.host_rate != pwasio->sample_rate ||
+       (context->filter && _filter_stale(pwasio, &config))))
+    _destroy_buffers(pwasio);
+  engine->maxsize = maxsize;
+  engine->blocksize = blocksize;
 
   char msg[sizeof pwasio->err_msg];
   LONG32 res;
-  if ((engine->fd = memfd_create("pwasio-buf", MFD_CLOEXEC)) < 0 ||
-      ftruncate(engine->fd, fsize) < 0 ||
-      (engine->buffer = mmap(nullptr, fsize, PROT_READ | PROT_WRITE, MAP_SHARED,
-                             engine->fd, 0)) == MAP_FAILED ||
-      !(engine->channels = malloc(n_channels * sizeof *engine->channels))) {
+  struct channel *next;
+  if (!(next = calloc(n_channels, sizeof *next))) {
     res = ASIO_ERROR_NO_MEMORY;
     snprintf(msg, sizeof msg, "buffer allocations failed");
     goto cleanup;
   }
-  WINE_TRACE("allocated fd %d\n", engine->fd);
+  for (size_t c = 0; c < (size_t)n_channels; c++)
+    next[c] = (typeof(next[c])){
+        .idx = channels[c].index,
+        .dir = channels[c].input ? PW_DIRECTION_INPUT : PW_DIRECTION_OUTPUT,
+    };
 
-  struct pw_properties *props;
-  if (!(props = pw_properties_copy(pw_core_get_properties(context->core)))) {
+  pw_thread_loop_lock(context->th_loop);
+  bool connect = false;
+  if (!context->filter && pwasio->backend == BACKEND_PIPEWIRE) {
+    struct pw_properties *props;
+    if (!(props = pw_properties_copy(pw_core_get_properties(context->core)))) {
+      res = ASIO_ERROR_NO_MEMORY;
+      snprintf(msg, sizeof msg, "failed to create PipeWire filter");
+      pw_thread_loop_unlock(context->th_loop);
+      goto cleanup;
+    }
+
+    pw_properties_set(props, PW_KEY_NODE_NAME, pwasio->name);
+    pw_properties_set(props, PW_KEY_NODE_GROUP,
+                      atomic_load(&pwasio->freewheel) ? FREEWHEEL_GROUP
+                                                      : DEFAULT_GROUP);
+    pw_properties_set(props, PW_KEY_NODE_DESCRIPTION, pwasio->name);
+    pw_properties_set(props, PW_KEY_MEDIA_TYPE, "Audio");
+    pw_properties_set(props, PW_KEY_MEDIA_CATEGORY, "Duplex");
+    pw_properties_set(props, PW_KEY_MEDIA_ROLE, "DSP");
+    pw_properties_set(props, PW_KEY_NODE_ALWAYS_PROCESS, "true");
+    if (pwasio->async)
+      pw_properties_set(props, PW_KEY_NODE_ASYNC, "true");
+    // the graph keeps its own rate when the host one gets converted
+    if (!reblock || pwasio->sample_rate == pwasio->graph_rate)
+      pw_properties_setf(props, PW_KEY_NODE_FORCE_RATE, "%lu",
+                         pwasio->sample_rate);
+    // when reblocking the buffer size is only a preference for the graph
+    if (reblock)
+      pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%d/%lu", buffer_size,
+                         pwasio->sample_rate);
+    else
+      pw_properties_setf(props, PW_KEY_NODE_FORCE_QUANTUM, "%d", buffer_size);
+
+    if (!(context->filter = pw_filter_new_simple(
+              pw_data_loop_get_loop(context->loop), pwasio->name, props,
+              &filter_events, engine))) {
+      res = ASIO_ERROR_NO_MEMORY;
+      snprintf(msg, sizeof msg, "failed to create PipeWire filter\n");
+      pw_properties_free(props);
+      pw_thread_loop_unlock(context->th_loop);
+      goto cleanup;
+    }
+    pwasio->filter_config = config;
+    connect = true;
+  } else if (context->filter &&
+             pwasio->filter_config.buffer_size != (size_t)buffer_size) {
+    char latency[64];
+    snprintf(latency, sizeof latency, "%d/%lu", buffer_size,
+             pwasio->sample_rate);
+    if (pw_filter_update_properties(
+            context->filter, nullptr,
+            &SPA_DICT_ITEMS(SPA_DICT_ITEM(PW_KEY_NODE_LATENCY, latency))) < 0)
+      WINE_WARN("unable to update node latency\n");
+    pwasio->filter_config.buffer_size = buffer_size;
+  }
+
+  // keep the ports and arena slots of channels that are still in use
+  size_t n_slots = engine->n_slots;
+  res = engine_setup_channels(engine, next, n_channels);
+  next = nullptr;
+  if (res < 0) {
+    snprintf(msg, sizeof msg, "buffer allocations failed: %s",
+             strerror(-res));
     res = ASIO_ERROR_NO_MEMORY;
-    snprintf(msg, sizeof msg, "failed to create PipeWire filter");
+    pw_thread_loop_unlock(context->th_loop);
+    goto cleanup;
+  }
+  if (engine->n_slots > n_slots)
+    WINE_TRACE("arena on fd %d grown to %lu slots\n", engine->fd,
+               engine->n_slots);
+
+  struct reblock *rb = &engine->reblock;
+  engine_clear_reblock(rb);
+  rb->host_rate = pwasio->sample_rate;
+  if ((rb->on = reblock) &&
+      (res = engine_setup_reblock(engine, buffer_size,
+                                  pwasio->graph_rate, pwasio->resample)) < 0) {
+    snprintf(msg, sizeof msg, "reblock setup failed: %s", strerror(-res));
+    res = ASIO_ERROR_NO_MEMORY;
+    pw_thread_loop_unlock(context->th_loop);
+    goto cleanup;
+  }
+  if (rb->rate)
+    WINE_TRACE("converting between %u and %u Hz\n", rb->rate, rb->host_rate);
+
+  engine->sanitize = pwasio->sanitize;
+
+  // the seconds asked are counted in cycles of the host buffer size, which
+  // is the graph quantum unless reblocking
+  engine_clear_flight(&engine->flight);
+  if (pwasio->flight &&
+      (res = engine_setup_flight(engine, pwasio->flight * pwasio->graph_rate /
+                                             buffer_size)) < 0) {
+    snprintf(msg, sizeof msg, "flight recorder setup failed: %s",
+             strerror(-res));
+    res = ASIO_ERROR_NO_MEMORY;
+    pw_thread_loop_unlock(context->th_loop);
     goto cleanup;
   }
 
-  pw_properties_set(props, PW_KEY_NODE_NAME, pwasio->name);
-  pw_properties_set(props, PW_KEY_NODE_GROUP, "group.dsp.0");
-  pw_properties_set(props, PW_KEY_NODE_DESCRIPTION, pwasio->name);
-  pw_properties_set(props, PW_KEY_MEDIA_TYPE, "Audio");
-  pw_properties_set(props, PW_KEY_MEDIA_CATEGORY, "Duplex");
-  pw_properties_set(props, PW_KEY_MEDIA_ROLE, "DSP");
-  pw_properties_set(props, PW_KEY_NODE_ALWAYS_PROCESS, "true");
-  pw_properties_setf(props, PW_KEY_NODE_FORCE_RATE, "%lu", pwasio->sample_rate);
-  pw_properties_setf(props, PW_KEY_NODE_FORCE_QUANTUM, "%d", buffer_size);
-
-  pw_thread_loop_lock(context->th_loop);
-  if (!(context->filter = pw_filter_new_simple(
-            pw_data_loop_get_loop(context->loop), pwasio->name, props,
-            &filter_events, engine))) {
+  struct watchdog *wd = &engine->watchdog;
+  free(wd->last);
+  wd->last = nullptr;
+  wd->len = wd->misses = 0;
+  atomic_store_explicit(&wd->overruns, 0, memory_order_relaxed);
+  atomic_store_explicit(&wd->worst, 0, memory_order_relaxed);
+  if ((wd->mode = pwasio->watchdog) != WATCHDOG_OFF &&
+      !(wd->last = calloc(n_channels * maxsize, sizeof(float)))) {
     res = ASIO_ERROR_NO_MEMORY;
-    snprintf(msg, sizeof msg, "failed to create PipeWire filter\n");
-    pw_properties_free(props);
+    snprintf(msg, sizeof msg, "buffer allocations failed");
     pw_thread_loop_unlock(context->th_loop);
     goto cleanup;
   }
-  size_t offset = 0;
+
   for (size_t c = 0; c < (size_t)n_channels; c++) {
     struct asio_buffer_info *info = &channels[c];
     struct channel *channel = &engine->channels[c];
-    *channel = (typeof(*channel)){
-        .idx = info->index,
-    };
+    size_t base = 2 * channel->slot * (maxsize + blocksize);
+    for (size_t b = 0; b < 2; b++) {
+      channel->offset[b] = (base + b * maxsize) * sizeof(float);
+      channel->host[b] =
+          blocksize ? (base + 2 * maxsize + b * blocksize) * sizeof(float)
+                    : channel->offset[b];
+      WINE_TRACE("%s %u buffer %lu @ %lu\n", info->input ? "input" : "output",
+                 info->index, b, channel->host[b]);
+      info->buf[b] = engine->buffer + channel->host[b] / sizeof(float);
+    }
+    if (!context->filter)
+      continue;
+    if (channel->port) {
+      *channel->port = c;
+      continue;
+    }
 
     struct pw_properties *props;
     if (!(props = pw_properties_new(nullptr, nullptr))) {
@@ -1286,22 +2356,14 @@ CreateBuffers(struct asio *_data, struct asio_buffer_info *channels,
       pw_thread_loop_unlock(context->th_loop);
       goto cleanup;
     }
-    if (info->input) {
+    if (info->input)
       pw_properties_setf(props, PW_KEY_PORT_NAME, "in_%d", info->index);
-      channel->dir = PW_DIRECTION_INPUT;
-    } else {
+    else
       pw_properties_setf(props, PW_KEY_PORT_NAME, "out_%d", info->index);
-      channel->dir = PW_DIRECTION_OUTPUT;
-    }
 
-    size_t idx = info->index;
-    const char *port;
-    for (port = (pwasio->ports[channel->dir]); *port;
-         port += strlen(port) + 1) {
-      if (!idx--)
-        break;
-    }
-    pw_properties_setf(props, PW_KEY_PORT_EXTRA, PWASIO_TARGET "%s", port);
+    pw_properties_setf(props, PW_KEY_PORT_EXTRA, PWASIO_TARGET "%s",
+                       engine_get_port(pwasio->ports[channel->dir],
+                                       info->index));
     char buf[MAX_STR];
     struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buf, sizeof buf);
     const struct spa_pod *params[] = {
@@ -1313,11 +2375,9 @@ CreateBuffers(struct asio *_data, struct asio_buffer_info *channels,
         spa_pod_builder_add_object(
             &b, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
             SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(2), SPA_PARAM_BUFFERS_size,
-            SPA_POD_Int(engine->maxsize * sizeof(float)),
-            SPA_PARAM_BUFFERS_stride, SPA_POD_Int(sizeof(float)),
-            SPA_PARAM_BUFFERS_align,
-            SPA_POD_Int(engine->maxsize * sizeof(float)),
-            SPA_PARAM_BUFFERS_dataType,
+            SPA_POD_Int(maxsize * sizeof(float)), SPA_PARAM_BUFFERS_stride,
+            SPA_POD_Int(sizeof(float)), SPA_PARAM_BUFFERS_align,
+            SPA_POD_Int(maxsize * sizeof(float)), SPA_PARAM_BUFFERS_dataType,
             SPA_POD_CHOICE_FLAGS_Int(1 << SPA_DATA_MemFd)),
     };
     if (!(channel->port = pw_filter_add_port(
@@ -1326,7 +2386,6 @@ CreateBuffers(struct asio *_data, struct asio_buffer_info *channels,
       res = ASIO_ERROR_NO_MEMORY;
       snprintf(msg, sizeof msg, "unable to allocate port for %s %d",
                info->input ? "input" : "output", info->index);
-      pw_properties_free(props);
       pw_thread_loop_unlock(context->th_loop);
       goto cleanup;
     }
@@ -1335,75 +2394,174 @@ CreateBuffers(struct asio *_data, struct asio_buffer_info *channels,
         &SPA_DICT_ITEMS(
             SPA_DICT_ITEM(PW_KEY_FORMAT_DSP, "32 bit float mono audio")));
     *channel->port = c;
-    for (size_t b = 0; b < 2; b++) {
-      channel->offset[b] = offset * sizeof(float);
-      WINE_TRACE("%s %u buffer %lu @ %lu\n", info->input ? "input" : "output",
-                 info->index, b, channel->offset[b]);
-      info->buf[b] = engine->buffer + offset;
-      offset += engine->maxsize;
-    }
   }
-  if (pw_filter_connect(context->filter, PW_FILTER_FLAG_NONE, nullptr, 0) < 0) {
+  if (connect &&
+      pw_filter_connect(context->filter, PW_FILTER_FLAG_NONE, nullptr, 0) < 0) {
     snprintf(msg, sizeof msg, "Failed to connect filter");
     res = ASIO_ERROR_NO_MEMORY;
     pw_thread_loop_unlock(context->th_loop);
     goto cleanup;
   }
+  if (context->filter)
+    _publish_latency(pwasio);
+  else if ((res = _setup_internal(pwasio)) < 0) {
+    snprintf(msg, sizeof msg, "%s backend setup failed: %s",
+             backend_names[pwasio->backend], strerror(-res));
+    res = ASIO_ERROR_HW_MALFUNCTION;
+    pw_thread_loop_unlock(context->th_loop);
+    goto cleanup;
+  }
+  engine->idx = 0;
+  pwasio->callbacks = callbacks;
+  pwasio->time_info =
+      callbacks->swap_buffers_time_info && callbacks->message &&
+      callbacks->message(ASIO_MESSAGE_SUPPORTED,
+                         ASIO_MESSAGE_SUPPORTS_TIME_INFO, nullptr,
+                         nullptr) == 1 &&
+      callbacks->message(ASIO_MESSAGE_SUPPORTS_TIME_INFO, 0, nullptr,
+                         nullptr) == 1;
+  // adapting needs a host that recreates its buffers when asked to, or at
+  // least resets the driver
+  struct load *load = &engine->load;
+  load->on = false;
+  if (pwasio->adapt.threshold && callbacks->message) {
+    load->on = callbacks->message(ASIO_MESSAGE_SUPPORTED,
+                                  ASIO_MESSAGE_BUFFER_SIZE_CHANGE, nullptr,
+                                  nullptr) == 1;
+    pwasio->adapt.reset =
+        !load->on && callbacks->message(ASIO_MESSAGE_SUPPORTED,
+                                        ASIO_MESSAGE_RESET_REQUEST, nullptr,
+                                        nullptr) == 1;
+    load->on |= pwasio->adapt.reset;
+  }
+  if (pwasio->adapt.threshold && !load->on)
+    WINE_WARN("host can't change buffer sizes, not adapting\n");
+  atomic_store_explicit(&load->overruns, 0, memory_order_relaxed);
+  if (pw_data_loop_start(context->loop) < 0) {
+    snprintf(msg, sizeof msg, "failed to start PipeWire data loop");
+    res = ASIO_ERROR_HW_MALFUNCTION;
+    pwasio->callbacks = nullptr;
+    pw_thread_loop_unlock(context->th_loop);
+    goto cleanup;
+  }
+  // a kept filter was taken out of the graph by DisposeBuffers
+  if (!connect && context->filter &&
+      pw_filter_set_active(context->filter, true) < 0)
+    WINE_WARN("unable to reactivate filter\n");
+  for (size_t c = 0; c < (size_t)n_channels; c++)
+    pwasio->table[engine->channels[c].dir]
+        .entries[engine->channels[c].idx]
+        .active = true;
   pw_thread_loop_unlock(context->th_loop);
 
+  free(used);
+
   return ASIO_ERROR_OK;
 
 cleanup:
-  if (context->filter) {
-    pw_thread_loop_lock(context->th_loop);
-    pw_filter_destroy(context->filter);
-    pw_thread_loop_unlock(context->th_loop);
-    context->filter = nullptr;
-  }
-  if (engine->channels)
-    free(engine->channels);
-  if (engine->buffer != MAP_FAILED)
-    munmap(engine->buffer, fsize);
-  if (engine->fd >= 0)
-    close(engine->fd);
+  free(next);
+  _destroy_buffers(pwasio);
 
   pwasio_err(res, "%s", msg);
 }
 STDMETHODIMP_(LONG32) DisposeBuffers(struct asio *_data) {
   WINE_TRACE("\n");
   struct pwasio *pwasio = (struct pwasio *)_data;
-  struct context *context = &pwasio->context;
+  const struct context *context = &pwasio->context;
 
   if (!*pwasio->ports[PW_DIRECTION_INPUT] &&
       !*pwasio->ports[PW_DIRECTION_OUTPUT])
     pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
 
-  if (!context->filter)
-    pwasio_err(ASIO_ERROR_INVALID_MODE, "no buffers");
-
   struct engine *engine = &pwasio->engine;
 
-  if (engine->running)
+  if (!pwasio->callbacks)
+    pwasio_err(ASIO_ERROR_INVALID_MODE, "no buffers");
+
+  if (atomic_load_explicit(&engine->running, memory_order_relaxed))
     pwasio->vtbl->Stop(_data);
 
+  // the filter and its ports stay around for the next CreateBuffers, while
+  // internal backends finish their files, but out of the graph so that the
+  // driver doesn't wait on a node that no longer processes
   pw_thread_loop_lock(context->th_loop);
-  pw_filter_destroy(context->filter);
+  if (context->filter && pw_filter_set_active(context->filter, false) < 0)
+    WINE_WARN("unable to deactivate filter\n");
+  int res = pw_data_loop_stop(context->loop);
+  _clear_internal(pwasio);
+  atomic_store(&engine->probe.state, PROBE_IDLE);
+  for (size_t i = 0; i < 2; i++)
+    engine_activate(&pwasio->table[i], false);
   pw_thread_loop_unlock(context->th_loop);
+  pwasio->callbacks = nullptr;
 
-  context->filter = nullptr;
-  free(engine->channels);
-  size_t fsize = 2 * engine->n_channels * engine->maxsize * sizeof(float);
-  munmap(engine->buffer, fsize);
-  close(engine->fd);
+  if (res < 0)
+    pwasio_err(ASIO_ERROR_HW_MALFUNCTION, "failed to stop PipeWire data loop");
 
   return ASIO_ERROR_OK;
 }
 
+// points the filter ports of one direction to a new set of targets with the
+// same channel count, relinking them in place
+static void _retarget(struct pwasio *pwasio, enum pw_direction dir,
+                      char *ports) {
+  struct context *context = &pwasio->context;
+  struct engine *engine = &pwasio->engine;
+
+  pw_thread_loop_lock(context->th_loop);
+  char *old = pwasio->ports[dir];
+  pwasio->ports[dir] = ports;
+  engine_name_channels(&engine->graph, ports, &pwasio->table[dir]);
+
+  if (context->filter)
+    for (size_t i = 0; i < engine->n_channels; i++) {
+      struct channel *channel = &engine->channels[i];
+      if (channel->dir != dir || !channel->port)
+        continue;
+      char extra[MAX_STR];
+      snprintf(extra, sizeof extra, PWASIO_TARGET "%s",
+               engine_get_port(ports, channel->idx));
+      pw_filter_update_properties(
+          context->filter, channel->port,
+          &SPA_DICT_ITEMS(SPA_DICT_ITEM(PW_KEY_PORT_EXTRA, extra)));
+    }
+
+  engine_retarget(engine, dir, ports);
+  pw_thread_loop_unlock(context->th_loop);
+
+  // leaked if there is no room to keep it, which beats freeing it under a
+  // host call
+  char **retired;
+  if (old == dummy_port)
+    return;
+  if (!(retired = realloc(pwasio->retired,
+                          (pwasio->n_retired + 1) * sizeof *retired))) {
+    WINE_WARN("unable to keep track of replaced port list\n");
+    return;
+  }
+  pwasio->retired = retired;
+  pwasio->retired[pwasio->n_retired++] = old;
+}
+
 struct panel {
   struct context *context;
   HWND tree[2], list[2];
   size_t buffer_size, sample_rate;
   int priority, host_priority;
+  char cpus[2][MAX_STR];
+  unsigned budget;
+  bool async, reblock;
+  enum resample_quality resample;
+  enum watchdog_mode watchdog;
+  bool sanitize;
+  size_t plugin_delay;
+  LONG correction, probed, latency;
+  bool probing;
+  bool freewheel;
+  struct engine *engine;
+  int dma_latency;
+  char governor[MAX_STR];
+  int qos_status;
   size_t len[2];
   char *ports[2];
 };
@@ -1449,11 +2607,13 @@ static LRESULT CALLBACK _checkbox_func(HWND tree, UINT uMsg, WPARAM wParam,
                                     .mask = LVIF_PARAM,
                                 }));
 
-    for (const struct node *node = panel->context->nodes; node;
-         node = node->next) {
+    const struct graph *graph = &panel->engine->graph;
+    for (const struct node *node = graph->nodes; node; node = node->next) {
       HTREEITEM hnode = nullptr;
       for (const struct port *port = node->ports[!uIdSubClass]; port;
            port = port->next) {
+        if (node == graph->unknown && port->peer != SPA_ID_INVALID)
+          continue;
         if (!hnode) {
           hnode = TreeView_InsertItem(
               tree,
@@ -1470,7 +2630,7 @@ static LRESULT CALLBACK _checkbox_func(HWND tree, UINT uMsg, WPARAM wParam,
               }));
         }
         char *name;
-        if (node == panel->context->unknown) {
+        if (node == graph->unknown) {
           if (!(name = strdup(port->name))) {
             PostMessage(tree, TVM_DESTROY, 0, 0);
             return TRUE;
@@ -1690,6 +2850,67 @@ static LRESULT CALLBACK _checkbox_func(HWND tree, UINT uMsg, WPARAM wParam,
   }
   return TRUE;
 }
+// counters kept by the data thread, refreshed while the panel is open
+#define PANEL_TIMER 1
+#define PANEL_TIMER_MS 500
+static void _panel_stats(HWND hWnd, const struct panel *panel) {
+  const struct engine *engine = panel->engine;
+  char str[MAX_STR];
+  uint64_t overruns =
+      atomic_load_explicit(&engine->watchdog.overruns, memory_order_relaxed);
+  if (overruns) {
+    snprintf(str, sizeof str, "late: %lu", overruns);
+    SetDlgItemText(hWnd, IDT_WATCHDOG, str);
+  }
+
+  size_t len = snprintf(str, sizeof str, "flushed:");
+  pw_thread_loop_lock(panel->context->th_loop);
+  for (size_t i = 0; i < engine->n_channels && len < sizeof str; i++) {
+    const struct channel *channel = &engine->channels[i];
+    uint64_t n =
+        atomic_load_explicit(&channel->sanitized, memory_order_relaxed);
+    if (channel->dir != PW_DIRECTION_INPUT && n)
+      len += snprintf(str + len, sizeof str - len, " out %lu: %lu",
+                      channel->idx, n);
+  }
+  pw_thread_loop_unlock(panel->context->th_loop);
+  SetDlgItemText(hWnd, IDT_SANITIZE, len > strlen("flushed:") ? str : "");
+}
+// the driver cpu list has no effect under SCHED_DEADLINE, see Init
+static void _panel_cpus(HWND hWnd) {
+  char cpus[MAX_STR];
+  BOOL conv;
+  UINT budget = GetDlgItemInt(hWnd, IDE_DEADLINE, &conv, false);
+  GetDlgItemText(hWnd, IDE_CPUS, cpus, sizeof cpus);
+  SetDlgItemText(hWnd, IDT_CPUS,
+                 conv && budget && *cpus ? "cpus (ignored)" : "cpus (driver)");
+}
+// a measured correction is offered next to the probe button, and only kept if
+// it is still checked when the panel is applied
+static void _panel_probe(HWND hWnd, struct panel *panel) {
+  const struct probe *probe = &panel->engine->probe;
+  char str[MAX_STR];
+  if (!panel->probing)
+    return;
+  switch (atomic_load_explicit(&probe->state, memory_order_acquire)) {
+  case PROBE_DONE: {
+    size_t frames = atomic_load_explicit(&probe->frames, memory_order_relaxed);
+    panel->probed = (LONG)frames - panel->latency;
+    snprintf(str, sizeof str, "%lu fr, %+ld", frames, (long)panel->probed);
+    SetDlgItemText(hWnd, IDC_PROBE_APPLY, str);
+    CheckDlgButton(hWnd, IDC_PROBE_APPLY, BST_CHECKED);
+  } break;
+  case PROBE_FAILED:
+    SetDlgItemText(hWnd, IDC_PROBE_APPLY, "no click heard");
+    break;
+  default:
+    return;
+  }
+  panel->probing = false;
+  EnableWindow(GetDlgItem(hWnd, IDC_PROBE), TRUE);
+  EnableWindow(GetDlgItem(hWnd, IDC_PROBE_APPLY), TRUE);
+}
+
 static INT_PTR CALLBACK _panel_func(HWND hWnd, UINT uMsg, WPARAM wParam,
                                     LPARAM lParam) {
   struct panel *panel = (typeof(panel))GetWindowLongPtr(hWnd, GWLP_USERDATA);
@@ -1716,6 +2937,39 @@ static INT_PTR CALLBACK _panel_func(HWND hWnd, UINT uMsg, WPARAM wParam,
     SetDlgItemInt(hWnd, IDE_SMPRATE, panel->sample_rate, false);
     SetDlgItemInt(hWnd, IDE_PRIORITY, panel->priority, false);
     SetDlgItemInt(hWnd, IDE_HOST_PRIORITY, panel->host_priority, false);
+    SetDlgItemText(hWnd, IDE_CPUS, panel->cpus[0]);
+    SetDlgItemText(hWnd, IDE_HOST_CPUS, panel->cpus[1]);
+    SetDlgItemInt(hWnd, IDE_DEADLINE, panel->budget, false);
+    SetDlgItemInt(hWnd, IDE_PLUGIN_DELAY, panel->plugin_delay, false);
+    SetDlgItemInt(hWnd, IDE_DMA_LATENCY, panel->dma_latency, true);
+    SetDlgItemText(hWnd, IDE_GOVERNOR, panel->governor);
+    CheckDlgButton(hWnd, IDC_ASYNC, panel->async ? BST_CHECKED : BST_UNCHECKED);
+    CheckDlgButton(hWnd, IDC_REBLOCK,
+                   panel->reblock ? BST_CHECKED : BST_UNCHECKED);
+    for (size_t i = 0; i < N_RESAMPLE_QUALITIES; i++)
+      SendDlgItemMessage(hWnd, IDC_RESAMPLE, CB_ADDSTRING, 0,
+                         (LPARAM)resample_names[i]);
+    SendDlgItemMessage(hWnd, IDC_RESAMPLE, CB_SETCURSEL, panel->resample, 0);
+    for (size_t i = 0; i < N_WATCHDOGS; i++)
+      SendDlgItemMessage(hWnd, IDC_WATCHDOG, CB_ADDSTRING, 0,
+                         (LPARAM)watchdog_names[i]);
+    SendDlgItemMessage(hWnd, IDC_WATCHDOG, CB_SETCURSEL, panel->watchdog, 0);
+    CheckDlgButton(hWnd, IDC_SANITIZE,
+                   panel->sanitize ? BST_CHECKED : BST_UNCHECKED);
+    CheckDlgButton(hWnd, IDC_FREEWHEEL,
+                   panel->freewheel ? BST_CHECKED : BST_UNCHECKED);
+    char str[MAX_STR];
+    snprintf(str, sizeof str, "correct %+ld", (long)panel->correction);
+    SetDlgItemText(hWnd, IDC_PROBE_APPLY, str);
+    CheckDlgButton(hWnd, IDC_PROBE_APPLY,
+                   panel->correction ? BST_CHECKED : BST_UNCHECKED);
+    _panel_cpus(hWnd);
+    _panel_stats(hWnd, panel);
+    SetTimer(hWnd, PANEL_TIMER, PANEL_TIMER_MS, nullptr);
+    if (panel->qos_status != QOS_IDLE)
+      SetDlgItemText(hWnd, IDT_QOS, panel->qos_status == QOS_GRANTED
+                                        ? "wake us: granted"
+                                        : "wake us: denied");
   } break;
   case WM_COMMAND:
     switch (LOWORD(wParam)) {
@@ -1737,6 +2991,29 @@ static INT_PTR CALLBACK _panel_func(HWND hWnd, UINT uMsg, WPARAM wParam,
     case IDC_OUTPUT_REMOVE:
       SendMessage(panel->tree[PW_DIRECTION_OUTPUT], TVM_REMOVE, 0, 0);
       break;
+    case IDE_CPUS:
+    case IDE_DEADLINE:
+      if (HIWORD(wParam) == EN_CHANGE)
+        _panel_cpus(hWnd);
+      break;
+    case IDC_PROBE: {
+      // between the selected output and input, or the first ones
+      int out = ListView_GetNextItem(panel->list[PW_DIRECTION_OUTPUT], -1,
+                                     LVNI_SELECTED);
+      int in = ListView_GetNextItem(panel->list[PW_DIRECTION_INPUT], -1,
+                                    LVNI_SELECTED);
+      pw_thread_loop_lock(panel->context->th_loop);
+      bool armed = engine_probe(panel->engine, SPA_MAX(out, 0), SPA_MAX(in, 0));
+      pw_thread_loop_unlock(panel->context->th_loop);
+      if (!armed) {
+        SetDlgItemText(hWnd, IDC_PROBE_APPLY, "not running");
+        break;
+      }
+      panel->probing = true;
+      SetDlgItemText(hWnd, IDC_PROBE_APPLY, "measuring...");
+      EnableWindow(GetDlgItem(hWnd, IDC_PROBE), FALSE);
+      EnableWindow(GetDlgItem(hWnd, IDC_PROBE_APPLY), FALSE);
+    } break;
     case IDOK:
       BOOL conv;
       INT val;
@@ -1752,6 +3029,43 @@ static INT_PTR CALLBACK _panel_func(HWND hWnd, UINT uMsg, WPARAM wParam,
       val = GetDlgItemInt(hWnd, IDE_HOST_PRIORITY, &conv, true);
       if (conv && val >= 0)
         panel->host_priority = val;
+      val = GetDlgItemInt(hWnd, IDE_DEADLINE, &conv, true);
+      if (conv && val >= 0 && val <= 100)
+        panel->budget = val;
+      val = GetDlgItemInt(hWnd, IDE_PLUGIN_DELAY, &conv, true);
+      if (conv && val >= 0)
+        panel->plugin_delay = val;
+      val = GetDlgItemInt(hWnd, IDE_DMA_LATENCY, &conv, true);
+      if (conv)
+        panel->dma_latency = SPA_MAX(val, -1);
+      GetDlgItemText(hWnd, IDE_GOVERNOR, panel->governor,
+                     sizeof panel->governor);
+      panel->async = IsDlgButtonChecked(hWnd, IDC_ASYNC) == BST_CHECKED;
+      panel->reblock = IsDlgButtonChecked(hWnd, IDC_REBLOCK) == BST_CHECKED;
+      panel->sanitize = IsDlgButtonChecked(hWnd, IDC_SANITIZE) == BST_CHECKED;
+      panel->freewheel =
+          IsDlgButtonChecked(hWnd, IDC_FREEWHEEL) == BST_CHECKED;
+      panel->correction =
+          IsDlgButtonChecked(hWnd, IDC_PROBE_APPLY) == BST_CHECKED
+              ? panel->probed
+              : 0;
+      val = SendDlgItemMessage(hWnd, IDC_RESAMPLE, CB_GETCURSEL, 0, 0);
+      if (val >= 0 && val < N_RESAMPLE_QUALITIES)
+        panel->resample = val;
+      val = SendDlgItemMessage(hWnd, IDC_WATCHDOG, CB_GETCURSEL, 0, 0);
+      if (val >= 0 && val < N_WATCHDOGS)
+        panel->watchdog = val;
+      for (size_t i = 0; i < 2; i++) {
+        char str[MAX_STR], msg[MAX_STR];
+        cpu_set_t cpus;
+        GetDlgItemText(hWnd, i ? IDE_HOST_CPUS : IDE_CPUS, str, sizeof str);
+        if (!_parse_cpus(str, &cpus))
+          continue;
+        strcpy(panel->cpus[i], str);
+        if (_check_irqs(&cpus, msg, sizeof msg))
+          MessageBox(hWnd, msg, i ? "host cpus" : "driver cpus",
+                     MB_OK | MB_ICONWARNING);
+      }
       for (size_t i = 0; i < 2; i++)
         SendMessage(panel->tree[i], TVM_PARSE, 0, 0);
     case IDCANCEL:
@@ -1759,7 +3073,14 @@ static INT_PTR CALLBACK _panel_func(HWND hWnd, UINT uMsg, WPARAM wParam,
       break;
     }
     break;
+  case WM_TIMER:
+    if (wParam == PANEL_TIMER) {
+      _panel_stats(hWnd, panel);
+      _panel_probe(hWnd, panel);
+    }
+    break;
   case WM_DESTROY:
+    KillTimer(hWnd, PANEL_TIMER);
     for (size_t i = 0; i < 2; i++)
       SendMessage(panel->tree[i], TVM_DESTROY, 0, 0);
     PostQuitMessage(0);
@@ -1775,12 +3096,31 @@ static DWORD WINAPI _panel_thread(LPVOID p) {
 
   struct panel panel = {
       .context = &pwasio->context,
-      .buffer_size = pwasio->buffer_size,
+      .buffer_size = pwasio->adapt.base,
       .sample_rate = pwasio->sample_rate,
       .priority = pwasio->thread.priority,
       .host_priority = pwasio->host_priority,
+      .budget = pwasio->thread.budget,
+      .async = pwasio->async,
+      .reblock = pwasio->reblock,
+      .resample = pwasio->resample,
+      .watchdog = pwasio->watchdog,
+      .sanitize = pwasio->sanitize,
+      .plugin_delay = pwasio->plugin_delay,
+      .correction = pwasio->latency_correction,
+      .probed = pwasio->latency_correction,
+      .freewheel = atomic_load(&pwasio->freewheel),
+      .engine = &pwasio->engine,
+      .dma_latency = pwasio->qos.latency,
+      .qos_status = pwasio->qos.status,
       .ports = {pwasio->ports[0], pwasio->ports[1]},
   };
+  for (size_t i = 0; i < 2; i++)
+    strcpy(panel.cpus[i], pwasio->cpus[i]);
+  strcpy(panel.governor, pwasio->qos.governor);
+  LONG in, out;
+  _latencies(pwasio, &in, &out);
+  panel.latency = in + out;
 
   InitCommonControlsEx(&(INITCOMMONCONTROLSEX){
       .dwSize = sizeof(INITCOMMONCONTROLSEX),
@@ -1808,11 +3148,13 @@ static DWORD WINAPI _panel_thread(LPVOID p) {
     key = nullptr;
 
   bool reset = false;
-  if (key && panel.buffer_size != pwasio->buffer_size) {
+  if (key && panel.buffer_size != pwasio->adapt.base) {
     if (RegSetValueEx(key, KEY_BUFSIZE, 0, REG_DWORD,
                       (BYTE *)&(DWORD){panel.buffer_size},
                       sizeof(DWORD)) != ERROR_SUCCESS)
       WINE_WARN("failed to write buffer size configuration\n");
+    // a size set by hand starts adaptation over
+    atomic_store(&adapted, 0);
     reset = true;
   }
   if (key && panel.sample_rate != pwasio->sample_rate) {
@@ -1836,27 +3178,118 @@ static DWORD WINAPI _panel_thread(LPVOID p) {
       WINE_WARN("failed to write host priority configuration\n");
     reset = true;
   }
+  if (key && panel.budget != pwasio->thread.budget) {
+    if (RegSetValueEx(key, KEY_DEADLINE, 0, REG_DWORD,
+                      (BYTE *)&(DWORD){panel.budget},
+                      sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write deadline configuration\n");
+    reset = true;
+  }
+  if (key && panel.async != pwasio->async) {
+    if (RegSetValueEx(key, KEY_ASYNC, 0, REG_DWORD,
+                      (BYTE *)&(DWORD){panel.async},
+                      sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write async configuration\n");
+    reset = true;
+  }
+  if (key && panel.reblock != pwasio->reblock) {
+    if (RegSetValueEx(key, KEY_REBLOCK, 0, REG_DWORD,
+                      (BYTE *)&(DWORD){panel.reblock},
+                      sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write reblock configuration\n");
+    reset = true;
+  }
+  if (key && panel.resample != pwasio->resample) {
+    if (RegSetValueEx(key, KEY_RESAMPLE, 0, REG_DWORD,
+                      (BYTE *)&(DWORD){panel.resample},
+                      sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write resampler configuration\n");
+    reset = true;
+  }
+  if (key && panel.watchdog != pwasio->watchdog) {
+    if (RegSetValueEx(key, KEY_WATCHDOG, 0, REG_DWORD,
+                      (BYTE *)&(DWORD){panel.watchdog},
+                      sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write watchdog configuration\n");
+    reset = true;
+  }
+  if (key && panel.sanitize != pwasio->sanitize) {
+    if (RegSetValueEx(key, KEY_SANITIZE, 0, REG_DWORD,
+                      (BYTE *)&(DWORD){panel.sanitize},
+                      sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write sanitizer configuration\n");
+    reset = true;
+  }
+  if (key && panel.plugin_delay != pwasio->plugin_delay) {
+    if (RegSetValueEx(key, KEY_PLUGIN_DELAY, 0, REG_DWORD,
+                      (BYTE *)&(DWORD){panel.plugin_delay},
+                      sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write plugin delay configuration\n");
+    reset = true;
+  }
+  // hosts only need to ask for latencies again
+  bool latencies = false;
+  if (panel.correction != pwasio->latency_correction) {
+    if (key && RegSetValueEx(key, KEY_LATENCY_CORRECTION, 0, REG_DWORD,
+                             (BYTE *)&(DWORD){panel.correction},
+                             sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write latency correction configuration\n");
+    pwasio->latency_correction = panel.correction;
+    latencies = true;
+  }
+  // only lasts for the session, renders are meant to end
+  _set_freewheel(pwasio, panel.freewheel);
+  if (key && panel.dma_latency != pwasio->qos.latency) {
+    if (RegSetValueEx(key, KEY_DMA_LATENCY, 0, REG_DWORD,
+                      (BYTE *)&(DWORD){panel.dma_latency},
+                      sizeof(DWORD)) != ERROR_SUCCESS)
+      WINE_WARN("failed to write wake latency configuration\n");
+    reset = true;
+  }
+  if (key && !spa_streq(panel.governor, pwasio->qos.governor)) {
+    if (RegSetValueEx(key, KEY_GOVERNOR, 0, REG_SZ, (BYTE *)panel.governor,
+                      strlen(panel.governor) + 1) != ERROR_SUCCESS)
+      WINE_WARN("failed to write governor configuration\n");
+    reset = true;
+  }
+  for (size_t i = 0; i < 2; i++)
+    if (key && !spa_streq(panel.cpus[i], pwasio->cpus[i])) {
+      if (RegSetValueEx(key, i ? KEY_HOST_CPUS : KEY_CPUS, 0, REG_SZ,
+                        (BYTE *)panel.cpus[i],
+                        strlen(panel.cpus[i]) + 1) != ERROR_SUCCESS)
+        WINE_WARN("failed to write cpu configuration\n");
+      reset = true;
+    }
   for (size_t i = 0; i < 2; i++) {
-    if (panel.ports[i] && panel.ports[i] != pwasio->ports[i]) {
-      for (const char *p = panel.ports[i], *q = pwasio->ports[i];
-           !reset && (*p || *q); p += strlen(p) + 1, q += strlen(q) + 1)
-        if (key && !spa_streq(p, q)) {
-          if (RegSetValueEx(key,
-                            i == PW_DIRECTION_INPUT ? KEY_INPUTS : KEY_OUTPUTS,
-                            0, REG_MULTI_SZ, (BYTE *)panel.ports[i],
-                            panel.len[i]) != ERROR_SUCCESS)
-            WINE_WARN("unable to write io configuration\n");
-          reset = true;
-        }
+    if (!panel.ports[i] || panel.ports[i] == pwasio->ports[i])
+      continue;
+    if (panel.len[i] == engine_sizeof_ports(pwasio->ports[i]) &&
+        !memcmp(panel.ports[i], pwasio->ports[i], panel.len[i])) {
       free(panel.ports[i]);
+      continue;
+    }
+    if (key && RegSetValueEx(key,
+                             i == PW_DIRECTION_INPUT ? KEY_INPUTS : KEY_OUTPUTS,
+                             0, REG_MULTI_SZ, (BYTE *)panel.ports[i],
+                             panel.len[i]) != ERROR_SUCCESS)
+      WINE_WARN("unable to write io configuration\n");
+    // the host only needs to know about changes in channel count
+    if (engine_count_ports(panel.ports[i]) == pwasio->table[i].len)
+      _retarget(pwasio, i, panel.ports[i]);
+    else {
+      free(panel.ports[i]);
+      reset = true;
     }
   }
   if (key)
     RegCloseKey(key);
 
-  if (reset && pwasio->engine.callbacks && pwasio->engine.callbacks->message)
-    pwasio->engine.callbacks->message(ASIO_MESSAGE_RESET_REQUEST, 0, nullptr,
+  if (reset && pwasio->callbacks && pwasio->callbacks->message)
+    pwasio->callbacks->message(ASIO_MESSAGE_RESET_REQUEST, 0, nullptr,
                                       nullptr);
+  else if (latencies && pwasio->callbacks && pwasio->callbacks->message)
+    pwasio->callbacks->message(ASIO_MESSAGE_LATENCIES_CHANGED, 0, nullptr,
+                               nullptr);
 
   pwasio->dialog = nullptr;
 
@@ -1880,6 +3313,25 @@ STDMETHODIMP_(LONG32) ControlPanel(struct asio *_data) {
 
   return ASIO_ERROR_OK;
 }
+STDMETHODIMP_(LONG32) Future(struct asio *_data, LONG32 sel, PVOID opt) {
+  WINE_TRACE("\n");
+  struct pwasio *pwasio = (struct pwasio *)_data;
+
+  if (!*pwasio->ports[PW_DIRECTION_INPUT] &&
+      !*pwasio->ports[PW_DIRECTION_OUTPUT])
+    pwasio_err(ASIO_ERROR_NOT_PRESENT, "no IO configured");
+
+  switch (sel) {
+  case ASIO_FUTURE_FREEWHEEL:
+    if (!opt)
+      pwasio_err(ASIO_ERROR_INVALID_PARAMETER, "no freewheel state");
+    _set_freewheel(pwasio, *(LONG32 *)opt);
+    return ASIO_ERROR_SUCCESS;
+  default:
+    return ASIO_ERROR_NOT_PRESENT;
+  }
+}
+
 STDMETHODIMP_(LONG32) not_impl() { return ASIO_ERROR_NOT_PRESENT; }
 
 HRESULT WINAPI CreateInstance(LPCLASSFACTORY _data, LPUNKNOWN outer, REFIID,
@@ -1919,15 +3371,27 @@ HRESULT WINAPI CreateInstance(LPCLASSFACTORY _data, LPUNKNOWN outer, REFIID,
       .CreateBuffers = CreateBuffers,
       .DisposeBuffers = DisposeBuffers,
       .ControlPanel = ControlPanel,
-      .Future = (void *)not_impl,
+      .Future = Future,
       .OutputReady = (void *)not_impl,
   };
   *pwasio = (typeof(*pwasio)){
       .vtbl = &vtbl,
       .ref = 1,
 
+      .serial = atomic_fetch_add(&serials, 1),
+
+      .engine =
+          {
+              .ops = &engine_ops,
+              .data = pwasio,
+              .fd = -1,
+              .buffer = MAP_FAILED,
+          },
+      .qos = {.fd = -1},
+
       .hinst = ((struct factory *)_data)->hinst,
   };
+  QueryPerformanceFrequency(&pwasio->qpc_freq);
 
   WINE_TRACE("starting PipeWire\n");
   pw_init(nullptr, nullptr);
@@ -1,6 +1,8 @@
 #ifndef __PWASIO_PWASIO_H__
 #define __PWASIO_PWASIO_H__
 
+#include "debug.h"
+
 #include <unknwn.h>
 
 static GUID const class_id = {
@@ -18,13 +20,4 @@ struct factory {
 
 HRESULT WINAPI CreateInstance(LPCLASSFACTORY, LPUNKNOWN, REFIID, LPVOID *);
 
-#ifdef DEBUG
-#include <wine/debug.h>
-#else
-#define WINE_DEFAULT_DEBUG_CHANNEL(...)
-#define WINE_TRACE(...)
-#define WINE_WARN(...)
-#define WINE_ERR(...)
-#endif
-
 #endif // !__PWASIO_PWASIO_H__
@@ -0,0 +1,185 @@
+/*
+Copyright (C) 2026 Gabriel Golfetti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "resample.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// kept free of Wine and PipeWire so that it can be benchmarked on its own
+
+const char *const resample_names[N_RESAMPLE_QUALITIES] = {
+    [RESAMPLE_OFF] = "off",
+    [RESAMPLE_LOW] = "low",
+    [RESAMPLE_MEDIUM] = "medium",
+    [RESAMPLE_HIGH] = "high",
+};
+
+static const struct {
+  size_t taps;
+  double cutoff, beta;
+} presets[N_RESAMPLE_QUALITIES] = {
+    [RESAMPLE_LOW] = {16, 0.85, 6.0},
+    [RESAMPLE_MEDIUM] = {32, 0.92, 8.0},
+    [RESAMPLE_HIGH] = {64, 0.96, 10.0},
+};
+
+// one phase per output frame of the reduced ratio, which keeps the filter
+// bank small for common ratios such as 147/160
+#define MAX_PHASES 1024
+#define LANES 8
+
+typedef float vec __attribute__((vector_size(LANES * sizeof(float))));
+
+static size_t _gcd(size_t a, size_t b) {
+  while (b) {
+    size_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+static double _bessel_i0(double x) {
+  double sum = 1, term = 1;
+  for (int k = 1; k < 64 && term > sum * 1e-12; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+static double _kaiser(double t, double beta) {
+  if (fabs(t) >= 1)
+    return 0;
+  return _bessel_i0(beta * sqrt(1 - t * t)) / _bessel_i0(beta);
+}
+static double _sinc(double x) {
+  if (fabs(x) < 1e-9)
+    return 1;
+  return sin(M_PI * x) / (M_PI * x);
+}
+static inline float _dot(const float *x, const float *h, size_t n) {
+  vec acc = {};
+  for (size_t i = 0; i < n; i += LANES) {
+    vec a;
+    memcpy(&a, x + i, sizeof a);
+    acc += a * *(const vec *)(h + i);
+  }
+  float sum = 0;
+  for (size_t i = 0; i < LANES; i++)
+    sum += acc[i];
+  return sum;
+}
+
+int resampler_init(struct resampler *r, uint32_t in_rate, uint32_t out_rate,
+                   enum resample_quality quality) {
+  if (!in_rate || !out_rate || quality <= RESAMPLE_OFF ||
+      quality >= N_RESAMPLE_QUALITIES)
+    return -EINVAL;
+
+  size_t g = _gcd(in_rate, out_rate);
+  r->up = out_rate / g;
+  r->down = in_rate / g;
+  if (r->up > MAX_PHASES)
+    return -ENOTSUP;
+
+  // downsampling moves the cutoff below the output nyquist frequency and
+  // widens the filter to keep the same transition band
+  double scale = r->up < r->down ? (double)r->up / r->down : 1.0;
+  r->taps = ceil(presets[quality].taps / scale);
+  r->taps = (r->taps + LANES - 1) / LANES * LANES;
+  double cutoff = presets[quality].cutoff * scale;
+
+  if (!(r->coeffs =
+            aligned_alloc(sizeof(vec), r->up * r->taps * sizeof(float))))
+    return -ENOMEM;
+  double half = r->taps / 2.0;
+  for (size_t p = 0; p < r->up; p++) {
+    float *h = r->coeffs + p * r->taps;
+    double sum = 0;
+    for (size_t j = 0; j < r->taps; j++) {
+      double x = j - (half - 1) - (double)p / r->up;
+      sum += h[j] = cutoff * _sinc(cutoff * x) *
+                    _kaiser(x / half, presets[quality].beta);
+    }
+    // unity gain at DC for every phase
+    for (size_t j = 0; j < r->taps; j++)
+      h[j] /= sum;
+  }
+  return 0;
+}
+void resampler_clear(struct resampler *r) {
+  free(r->coeffs);
+  r->coeffs = nullptr;
+}
+size_t resampler_delay(const struct resampler *r) { return r->taps / 2; }
+
+int resample_state_init(struct resample_state *s, const struct resampler *r,
+                        size_t max_in) {
+  s->max = r->taps + 2 * max_in;
+  if (!(s->buf = malloc(s->max * sizeof(float))))
+    return -ENOMEM;
+  resample_state_reset(s, r);
+  return 0;
+}
+void resample_state_reset(struct resample_state *s,
+                          const struct resampler *r) {
+  s->len = r->taps - 1;
+  memset(s->buf, 0, s->len * sizeof(float));
+  s->index = 0;
+  s->phase = 0;
+}
+void resample_state_clear(struct resample_state *s) {
+  free(s->buf);
+  s->buf = nullptr;
+}
+
+size_t resample_needed(const struct resample_state *s,
+                       const struct resampler *r, size_t n_out) {
+  if (!n_out)
+    return 0;
+  size_t last = s->index + (s->phase + (n_out - 1) * r->down) / r->up;
+  return last + r->taps > s->len ? last + r->taps - s->len : 0;
+}
+
+size_t resample_run(const struct resampler *r, struct resample_state *s,
+                    const float *in, size_t n_in, float *out, size_t n_out) {
+  if (n_in > s->max - s->len)
+    n_in = s->max - s->len;
+  if (in)
+    memcpy(s->buf + s->len, in, n_in * sizeof(float));
+  else
+    memset(s->buf + s->len, 0, n_in * sizeof(float));
+  s->len += n_in;
+
+  size_t k = 0;
+  for (; k < n_out && s->index + r->taps <= s->len; k++) {
+    if (out)
+      out[k] = _dot(s->buf + s->index, r->coeffs + s->phase * r->taps, r->taps);
+    s->phase += r->down;
+    s->index += s->phase / r->up;
+    s->phase %= r->up;
+  }
+
+  // drop whatever no later output can reach
+  size_t done = s->index < s->len ? s->index : s->len;
+  memmove(s->buf, s->buf + done, (s->len - done) * sizeof(float));
+  s->len -= done;
+  s->index -= done;
+  return k;
+}
@@ -0,0 +1,49 @@
+#ifndef __PWASIO_RESAMPLE_H__
+#define __PWASIO_RESAMPLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum resample_quality {
+  RESAMPLE_OFF,
+  RESAMPLE_LOW,
+  RESAMPLE_MEDIUM,
+  RESAMPLE_HIGH,
+  N_RESAMPLE_QUALITIES,
+};
+extern const char *const resample_names[N_RESAMPLE_QUALITIES];
+
+// polyphase windowed sinc filter bank for a rational rate ratio, which is
+// shared by every channel converting between the same rates
+struct resampler {
+  uint32_t up, down;
+  size_t taps;
+  float *coeffs;
+};
+// per channel history, which holds taps - 1 samples between calls
+struct resample_state {
+  float *buf;
+  size_t len, max, index, phase;
+};
+
+int resampler_init(struct resampler *r, uint32_t in_rate, uint32_t out_rate,
+                   enum resample_quality quality);
+void resampler_clear(struct resampler *r);
+// input frames of delay introduced by the filter
+size_t resampler_delay(const struct resampler *r);
+
+// max_in bounds the input frames of a single call
+int resample_state_init(struct resample_state *s, const struct resampler *r,
+                        size_t max_in);
+void resample_state_reset(struct resample_state *s, const struct resampler *r);
+void resample_state_clear(struct resample_state *s);
+// input frames needed before n_out more frames can be produced
+size_t resample_needed(const struct resample_state *s,
+                       const struct resampler *r, size_t n_out);
+// consumes all n_in frames and returns how many of at most n_out frames were
+// produced, frames that don't fit stay in the history for the next call, a
+// null input stands for silence and a null output only advances the state
+size_t resample_run(const struct resampler *r, struct resample_state *s,
+                    const float *in, size_t n_in, float *out, size_t n_out);
+
+#endif // !__PWASIO_RESAMPLE_H__
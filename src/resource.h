@@ -4,6 +4,24 @@
 #define IDE_SMPRATE 1002
 #define IDE_PRIORITY 1003
 #define IDE_HOST_PRIORITY 1004
+#define IDE_CPUS 1005
+#define IDE_HOST_CPUS 1006
+#define IDE_DEADLINE 1007
+#define IDE_DMA_LATENCY 1008
+#define IDE_GOVERNOR 1009
+#define IDT_QOS 1010
+#define IDC_ASYNC 1011
+#define IDC_REBLOCK 1012
+#define IDC_RESAMPLE 1013
+#define IDC_WATCHDOG 1014
+#define IDT_WATCHDOG 1015
+#define IDC_SANITIZE 1016
+#define IDT_SANITIZE 1017
+#define IDE_PLUGIN_DELAY 1018
+#define IDC_FREEWHEEL 1019
+#define IDC_PROBE 1020
+#define IDC_PROBE_APPLY 1021
+#define IDT_CPUS 1022
 
 #define IDC_INPUT_TREE 1101
 #define IDC_INPUT_LIST 1102
@@ -0,0 +1,167 @@
+/*
+Copyright (C) 2026 Gabriel Golfetti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rtkit.h"
+#include "debug.h"
+
+#include <dbus/dbus.h>
+#include <errno.h>
+#include <spa/utils/defs.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+WINE_DEFAULT_DEBUG_CHANNEL(pwasio);
+
+#define RTKIT_SERVICE "org.freedesktop.RealtimeKit1"
+#define RTKIT_PATH "/org/freedesktop/RealtimeKit1"
+
+static bool _get_property(struct rtkit *rtkit, const char *name,
+                          long long *value) {
+  DBusMessage *msg, *reply = nullptr;
+  if (!(msg = dbus_message_new_method_call(RTKIT_SERVICE, RTKIT_PATH,
+                                           DBUS_INTERFACE_PROPERTIES, "Get")))
+    return false;
+
+  const char *iface = RTKIT_SERVICE;
+  DBusError err;
+  dbus_error_init(&err);
+  bool res = false;
+  if (!dbus_message_append_args(msg, DBUS_TYPE_STRING, &iface,
+                                DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID) ||
+      !(reply = dbus_connection_send_with_reply_and_block(
+            rtkit->bus, msg, -1, &err))) {
+    WINE_WARN("unable to get RTKit %s: %s\n", name,
+              dbus_error_is_set(&err) ? err.message : "out of memory");
+    goto cleanup;
+  }
+
+  DBusMessageIter iter, variant;
+  if (!dbus_message_iter_init(reply, &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+    goto cleanup;
+  dbus_message_iter_recurse(&iter, &variant);
+  switch (dbus_message_iter_get_arg_type(&variant)) {
+  case DBUS_TYPE_INT32: {
+    int32_t v;
+    dbus_message_iter_get_basic(&variant, &v);
+    *value = v;
+    res = true;
+  } break;
+  case DBUS_TYPE_INT64: {
+    int64_t v;
+    dbus_message_iter_get_basic(&variant, &v);
+    *value = v;
+    res = true;
+  } break;
+  }
+
+cleanup:
+  dbus_error_free(&err);
+  if (reply)
+    dbus_message_unref(reply);
+  dbus_message_unref(msg);
+  return res;
+}
+
+bool rtkit_open(struct rtkit *rtkit) {
+  // the driver and host threads may be promoted concurrently
+  if (!dbus_threads_init_default())
+    return false;
+
+  DBusError err;
+  dbus_error_init(&err);
+
+  DBusConnection *bus;
+  const char *addr;
+  if ((addr = getenv("PWASIO_RTKIT_BUS"))) {
+    if ((bus = dbus_connection_open_private(addr, &err)) &&
+        !dbus_bus_register(bus, &err)) {
+      dbus_connection_close(bus);
+      dbus_connection_unref(bus);
+      bus = nullptr;
+    }
+  } else
+    bus = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+  if (!bus) {
+    WINE_WARN("unable to connect to RTKit: %s\n", err.message);
+    dbus_error_free(&err);
+    return false;
+  }
+  dbus_connection_set_exit_on_disconnect(bus, false);
+  rtkit->bus = bus;
+
+  long long priority;
+  if (!_get_property(rtkit, "MaxRealtimePriority", &priority) ||
+      !_get_property(rtkit, "RTTimeUSecMax", &rtkit->max_rttime)) {
+    rtkit_close(rtkit);
+    return false;
+  }
+  rtkit->max_priority = priority;
+
+  // RTKit refuses to promote processes without a bounded RLIMIT_RTTIME
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_RTTIME, &rl))
+    rl.rlim_max = RLIM_INFINITY;
+  if (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > (rlim_t)rtkit->max_rttime)
+    rl.rlim_max = rtkit->max_rttime;
+  if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > rl.rlim_max)
+    rl.rlim_cur = rl.rlim_max;
+  if (setrlimit(RLIMIT_RTTIME, &rl)) {
+    WINE_WARN("unable to limit realtime CPU time\n");
+    rtkit_close(rtkit);
+    return false;
+  }
+
+  WINE_TRACE("RTKit allows priority %d for %lld us\n", rtkit->max_priority,
+             rtkit->max_rttime);
+  return true;
+}
+
+int rtkit_make_realtime(struct rtkit *rtkit, pid_t pid, int priority) {
+  DBusMessage *msg, *reply;
+  if (!(msg = dbus_message_new_method_call(
+            RTKIT_SERVICE, RTKIT_PATH, RTKIT_SERVICE, "MakeThreadRealtime")))
+    return -ENOMEM;
+
+  uint64_t thread = pid;
+  uint32_t prio = SPA_MIN(priority, rtkit->max_priority);
+  DBusError err;
+  dbus_error_init(&err);
+  int res = 0;
+  if (!dbus_message_append_args(msg, DBUS_TYPE_UINT64, &thread,
+                                DBUS_TYPE_UINT32, &prio, DBUS_TYPE_INVALID))
+    res = -ENOMEM;
+  else if (!(reply = dbus_connection_send_with_reply_and_block(
+                 rtkit->bus, msg, -1, &err))) {
+    WINE_ERR("RTKit refused thread %d: %s\n", pid, err.message);
+    res = -EPERM;
+  } else
+    dbus_message_unref(reply);
+
+  dbus_error_free(&err);
+  dbus_message_unref(msg);
+  return res;
+}
+
+void rtkit_close(struct rtkit *rtkit) {
+  if (!rtkit->bus)
+    return;
+  dbus_connection_close(rtkit->bus);
+  dbus_connection_unref(rtkit->bus);
+  rtkit->bus = nullptr;
+}
@@ -0,0 +1,21 @@
+#ifndef __PWASIO_RTKIT_H__
+#define __PWASIO_RTKIT_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct DBusConnection;
+
+// realtime scheduling through RealtimeKit for users without rlimits, the bus
+// can be overriden through PWASIO_RTKIT_BUS to talk to a stand-in service
+struct rtkit {
+  struct DBusConnection *bus;
+  int max_priority;
+  long long max_rttime;
+};
+
+bool rtkit_open(struct rtkit *rtkit);
+int rtkit_make_realtime(struct rtkit *rtkit, pid_t pid, int priority);
+void rtkit_close(struct rtkit *rtkit);
+
+#endif // !__PWASIO_RTKIT_H__
@@ -0,0 +1,176 @@
+/*
+Copyright (C) 2026 Gabriel Golfetti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "wav.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define WAV_PCM 1
+#define WAV_FLOAT 3
+#define WAV_EXTENSIBLE 0xfffe
+#define WAV_HEADER 44
+
+static uint16_t _u16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t _u32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static void _put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+static void _put32(uint8_t *p, uint32_t v) {
+  _put16(p, v);
+  _put16(p + 2, v >> 16);
+}
+
+int wav_open_read(struct wav *wav, const char *path) {
+  *wav = (struct wav){};
+  if (!(wav->file = fopen(path, "rb")))
+    return -errno;
+
+  uint8_t hdr[12];
+  if (fread(hdr, sizeof hdr, 1, wav->file) != 1 || memcmp(hdr, "RIFF", 4) ||
+      memcmp(hdr + 8, "WAVE", 4))
+    goto invalid;
+
+  // chunks are walked until the samples, with the format coming first
+  while (true) {
+    uint8_t chunk[8];
+    if (fread(chunk, sizeof chunk, 1, wav->file) != 1)
+      goto invalid;
+    uint32_t size = _u32(chunk + 4);
+    if (!memcmp(chunk, "fmt ", 4)) {
+      uint8_t fmt[40] = {};
+      if (size < 16 ||
+          fread(fmt, size < sizeof fmt ? size : sizeof fmt, 1, wav->file) !=
+              1 ||
+          (size > sizeof fmt && fseek(wav->file, size - sizeof fmt, SEEK_CUR)))
+        goto invalid;
+      wav->format = _u16(fmt);
+      wav->channels = _u16(fmt + 2);
+      wav->rate = _u32(fmt + 4);
+      wav->bits = _u16(fmt + 14);
+      if (wav->format == WAV_EXTENSIBLE && size >= 26)
+        wav->format = _u16(fmt + 24);
+    } else if (!memcmp(chunk, "data", 4)) {
+      if (!wav->channels || !wav->bits)
+        goto invalid;
+      wav->frames = wav->left = size / (wav->channels * (wav->bits / 8));
+      break;
+    } else if (fseek(wav->file, size + (size & 1), SEEK_CUR))
+      goto invalid;
+  }
+
+  if ((wav->format == WAV_PCM &&
+       (wav->bits == 16 || wav->bits == 24 || wav->bits == 32)) ||
+      (wav->format == WAV_FLOAT && wav->bits == 32))
+    return 0;
+  fclose(wav->file);
+  wav->file = nullptr;
+  return -ENOTSUP;
+
+invalid:
+  fclose(wav->file);
+  wav->file = nullptr;
+  return -EINVAL;
+}
+
+int wav_open_write(struct wav *wav, const char *path, uint16_t channels,
+                   uint32_t rate) {
+  *wav = (struct wav){
+      .write = true,
+      .format = WAV_FLOAT,
+      .bits = 32,
+      .channels = channels,
+      .rate = rate,
+  };
+  if (!(wav->file = fopen(path, "wb")))
+    return -errno;
+  // sizes are left for wav_close
+  uint8_t hdr[WAV_HEADER] = "RIFF\0\0\0\0WAVEfmt ";
+  _put32(hdr + 16, 16);
+  _put16(hdr + 20, wav->format);
+  _put16(hdr + 22, channels);
+  _put32(hdr + 24, rate);
+  _put32(hdr + 28, rate * channels * sizeof(float));
+  _put16(hdr + 32, channels * sizeof(float));
+  _put16(hdr + 34, wav->bits);
+  memcpy(hdr + 36, "data", 4);
+  if (fwrite(hdr, sizeof hdr, 1, wav->file) != 1) {
+    fclose(wav->file);
+    wav->file = nullptr;
+    return -EIO;
+  }
+  return 0;
+}
+
+size_t wav_read(struct wav *wav, float *buf, size_t frames) {
+  frames = frames < wav->left ? frames : wav->left;
+  size_t width = wav->bits / 8;
+  // samples are unpacked in place, from the back so nothing gets overwritten
+  uint8_t *raw = (uint8_t *)buf;
+  if ((frames = fread(raw, width * wav->channels, frames, wav->file)) == 0) {
+    wav->left = 0;
+    return 0;
+  }
+  wav->left -= frames;
+  size_t n = frames * wav->channels;
+  if (wav->format == WAV_FLOAT)
+    return frames;
+  for (size_t i = n; i-- > 0;) {
+    const uint8_t *p = raw + i * width;
+    int32_t v;
+    switch (width) {
+    case 2:
+      v = (int32_t)((uint32_t)_u16(p) << 16);
+      break;
+    case 3:
+      v = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 |
+                    (uint32_t)p[2] << 24);
+      break;
+    default:
+      v = (int32_t)_u32(p);
+      break;
+    }
+    buf[i] = v * (1.0f / 2147483648.0f);
+  }
+  return frames;
+}
+
+size_t wav_write(struct wav *wav, const float *buf, size_t frames) {
+  frames = fwrite(buf, wav->channels * sizeof(float), frames, wav->file);
+  wav->frames += frames;
+  return frames;
+}
+
+void wav_close(struct wav *wav) {
+  if (!wav->file)
+    return;
+  if (wav->write) {
+    uint8_t size[4];
+    uint32_t data = wav->frames * wav->channels * sizeof(float);
+    _put32(size, WAV_HEADER - 8 + data);
+    if (!fseek(wav->file, 4, SEEK_SET))
+      fwrite(size, sizeof size, 1, wav->file);
+    _put32(size, data);
+    if (!fseek(wav->file, WAV_HEADER - 4, SEEK_SET))
+      fwrite(size, sizeof size, 1, wav->file);
+  }
+  fclose(wav->file);
+  wav->file = nullptr;
+}
@@ -0,0 +1,27 @@
+#ifndef __PWASIO_WAV_H__
+#define __PWASIO_WAV_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// RIFF WAVE files as inputs and outputs of the internal backends, read as
+// 16, 24 or 32 bit integers or 32 bit floats and written as the latter
+struct wav {
+  FILE *file;
+  bool write;
+  uint16_t format, bits, channels;
+  uint32_t rate;
+  size_t frames, left;
+};
+
+int wav_open_read(struct wav *wav, const char *path);
+int wav_open_write(struct wav *wav, const char *path, uint16_t channels,
+                   uint32_t rate);
+// interleaved frames, reads return fewer once the file runs out
+size_t wav_read(struct wav *wav, float *buf, size_t frames);
+size_t wav_write(struct wav *wav, const float *buf, size_t frames);
+// fills in the sizes of written files
+void wav_close(struct wav *wav);
+
+#endif // !__PWASIO_WAV_H__
@@ -0,0 +1,137 @@
+/*
+Copyright (C) 2026 Gabriel Golfetti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <dbus/dbus.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// a stand-in for RealtimeKit on a private bus, which answers the properties
+// the driver reads and checks promotions the way the real service does, but
+// only reports them since it runs without privileges
+
+#define RTKIT_SERVICE "org.freedesktop.RealtimeKit1"
+#define RTKIT_PATH "/org/freedesktop/RealtimeKit1"
+
+#define MAX_PRIORITY 20
+#define MIN_NICE -15
+#define MAX_RTTIME 200000
+
+static DBusMessage *_get(DBusMessage *msg) {
+  const char *iface, *name;
+  if (!dbus_message_get_args(msg, nullptr, DBUS_TYPE_STRING, &iface,
+                             DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID) ||
+      strcmp(iface, RTKIT_SERVICE))
+    return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS,
+                                  "unknown interface");
+
+  DBusMessage *reply = dbus_message_new_method_return(msg);
+  DBusMessageIter iter, variant;
+  dbus_message_iter_init_append(reply, &iter);
+  if (!strcmp(name, "MaxRealtimePriority") || !strcmp(name, "MinNiceLevel")) {
+    int32_t v = name[1] == 'a' ? MAX_PRIORITY : MIN_NICE;
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT,
+                                     DBUS_TYPE_INT32_AS_STRING, &variant);
+    dbus_message_iter_append_basic(&variant, DBUS_TYPE_INT32, &v);
+  } else if (!strcmp(name, "RTTimeUSecMax")) {
+    int64_t v = MAX_RTTIME;
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT,
+                                     DBUS_TYPE_INT64_AS_STRING, &variant);
+    dbus_message_iter_append_basic(&variant, DBUS_TYPE_INT64, &v);
+  } else {
+    dbus_message_unref(reply);
+    return dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_PROPERTY, name);
+  }
+  dbus_message_iter_close_container(&iter, &variant);
+  return reply;
+}
+
+// RealtimeKit only promotes threads that exist, up to its maximum priority,
+// in processes that bound their realtime CPU time
+static DBusMessage *_make_realtime(DBusMessage *msg) {
+  uint64_t thread;
+  uint32_t priority;
+  if (!dbus_message_get_args(msg, nullptr, DBUS_TYPE_UINT64, &thread,
+                             DBUS_TYPE_UINT32, &priority, DBUS_TYPE_INVALID))
+    return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, "thread");
+
+  char path[64];
+  snprintf(path, sizeof path, "/proc/%lu", thread);
+  struct rlimit rl;
+  const char *refusal = nullptr;
+  if (!priority || priority > MAX_PRIORITY)
+    refusal = "priority out of range";
+  else if (access(path, F_OK))
+    refusal = "no such thread";
+  else if (prlimit(thread, RLIMIT_RTTIME, nullptr, &rl) ||
+           rl.rlim_max == RLIM_INFINITY || rl.rlim_max > MAX_RTTIME)
+    refusal = "RLIMIT_RTTIME not bounded";
+  printf("thread %lu priority %u: %s\n", thread, priority,
+         refusal ? refusal : "granted");
+  fflush(stdout);
+  if (refusal)
+    return dbus_message_new_error(msg, DBUS_ERROR_ACCESS_DENIED, refusal);
+  return dbus_message_new_method_return(msg);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s bus-address\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  DBusError err;
+  dbus_error_init(&err);
+  DBusConnection *bus;
+  if (!(bus = dbus_connection_open_private(argv[1], &err)) ||
+      !dbus_bus_register(bus, &err) ||
+      dbus_bus_request_name(bus, RTKIT_SERVICE, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                            &err) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+    fprintf(stderr, "unable to take %s: %s\n", RTKIT_SERVICE,
+            dbus_error_is_set(&err) ? err.message : "name taken");
+    return EXIT_FAILURE;
+  }
+  printf("ready\n");
+  fflush(stdout);
+
+  while (dbus_connection_read_write(bus, -1)) {
+    DBusMessage *msg, *reply = nullptr;
+    while ((msg = dbus_connection_pop_message(bus))) {
+      if (dbus_message_is_method_call(msg, DBUS_INTERFACE_PROPERTIES, "Get"))
+        reply = _get(msg);
+      else if (dbus_message_is_method_call(msg, RTKIT_SERVICE,
+                                           "MakeThreadRealtime"))
+        reply = _make_realtime(msg);
+      else if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+        reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD,
+                                       dbus_message_get_member(msg));
+      if (reply) {
+        dbus_connection_send(bus, reply, nullptr);
+        dbus_message_unref(reply);
+        reply = nullptr;
+      }
+      dbus_message_unref(msg);
+    }
+  }
+
+  dbus_connection_close(bus);
+  dbus_connection_unref(bus);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (C) 2026 Gabriel Golfetti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rtkit.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// the RTKit path the driver takes when RLIMIT_RTPRIO can't be raised, run
+// against the stand-in with its maximum priority of 20 and 200 ms of realtime
+// CPU time
+
+static struct rtkit rtkit;
+static int failures;
+
+static void _check(bool ok, const char *what) {
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+  failures += !ok;
+}
+
+// host threads get promoted concurrently with the driver thread
+static void *_promote(void *) {
+  _check(!rtkit_make_realtime(&rtkit, gettid(), 10),
+         "promotes a second thread");
+  return nullptr;
+}
+
+int main(void) {
+  if (!getenv("PWASIO_RTKIT_BUS")) {
+    fprintf(stderr, "PWASIO_RTKIT_BUS must point to the stand-in's bus\n");
+    return EXIT_FAILURE;
+  }
+
+  _check(rtkit_open(&rtkit), "connects to the stand-in");
+  if (!rtkit.bus)
+    return EXIT_FAILURE;
+  _check(rtkit.max_priority == 20, "reads MaxRealtimePriority");
+  _check(rtkit.max_rttime == 200000, "reads RTTimeUSecMax");
+
+  struct rlimit rl;
+  _check(!getrlimit(RLIMIT_RTTIME, &rl) && rl.rlim_max != RLIM_INFINITY &&
+             rl.rlim_max <= 200000 && rl.rlim_cur <= rl.rlim_max,
+         "bounds RLIMIT_RTTIME");
+
+  _check(!rtkit_make_realtime(&rtkit, gettid(), 99),
+         "caps the priority asked for");
+  pthread_t thread;
+  _check(!pthread_create(&thread, nullptr, _promote, nullptr) &&
+             !pthread_join(thread, nullptr),
+         "runs a second thread");
+  _check(rtkit_make_realtime(&rtkit, 0x3ffffff0, 10) == -EPERM,
+         "reports refusals");
+
+  rtkit_close(&rtkit);
+  _check(!rtkit.bus, "closes the connection");
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Runs the RTKit check against the stand-in on a private bus, so that neither
+# the system bus nor the real service are involved.
+#
+# usage: rtkit.sh rtkit-standin rtkit-check
+set -eu
+
+standin=$(realpath "${1:?usage: rtkit.sh rtkit-standin rtkit-check}")
+check=$(realpath "${2:?usage: rtkit.sh rtkit-standin rtkit-check}")
+
+tmp=$(mktemp -d)
+bus=
+service=
+cleanup() {
+  [ -z "$service" ] || kill "$service" 2>/dev/null || true
+  [ -z "$bus" ] || kill "$bus" 2>/dev/null || true
+  rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+cat >"$tmp/bus.conf" <<EOF
+<busconfig>
+  <type>session</type>
+  <listen>unix:path=$tmp/bus</listen>
+  <auth>EXTERNAL</auth>
+  <policy context="default">
+    <allow send_destination="*" eavesdrop="true"/>
+    <allow eavesdrop="true"/>
+    <allow own="*"/>
+  </policy>
+</busconfig>
+EOF
+dbus-daemon --config-file="$tmp/bus.conf" --nofork >"$tmp/bus.log" 2>&1 &
+bus=$!
+address=unix:path=$tmp/bus
+
+wait_for() {
+  i=0
+  while ! eval "$1"; do
+    if [ $i -ge 50 ]; then
+      cat "$tmp"/*.log >&2
+      echo "$2" >&2
+      exit 1
+    fi
+    sleep 0.1
+    i=$((i + 1))
+  done
+}
+wait_for '[ -S "$tmp/bus" ]' "the bus did not come up"
+"$standin" "$address" >"$tmp/standin.log" 2>&1 &
+service=$!
+wait_for 'grep -q ready "$tmp/standin.log"' "the stand-in did not come up"
+
+res=0
+PWASIO_RTKIT_BUS=$address "$check" || res=$?
+sed -n 's/^thread/stand-in: thread/p' "$tmp/standin.log"
+exit $res